@@ -0,0 +1,40 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Size of the chunks read from /proc/<pid>/mem when process_vm_readv is not
+// available
+#define CAPTURE_CHUNK_SIZE (1 << 20)
+
+// Reads the memory of a process with process_vm_readv, or through a single
+// /proc/<pid>/mem file descriptor as a fallback
+typedef struct {
+  pid_t pid;
+  bool use_vm_readv;
+  int mem_fd; // for the pages process_vm_readv cannot read
+  size_t unreadable_pages;
+} capture_t;
+
+// Function to start reading the memory of the process. It fails if the
+// process is gone or its memory cannot be read by us, before anything is
+// read.
+int capture_open(capture_t *capture, pid_t pid);
+
+void capture_close(capture_t *capture);
+
+// Function to read count ranges of the process: remote[i] is copied to
+// local[i], both of the same length. Batches of up to IOV_MAX ranges are
+// read with one syscall. Pages that cannot be read are zero-filled and
+// counted in unreadable_pages rather than failing the whole capture.
+int capture_read(capture_t *capture, const struct iovec *local,
+                 const struct iovec *remote, size_t count);
+
+// Function to read a single range of the process
+int capture_read_range(capture_t *capture, char *buf, unsigned long start,
+                       size_t size);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -16,6 +17,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "pagemap.h"
+#include "ptrace.h"
+#include "stream.h"
+
+// A range of populated pages of a sparse region
+typedef struct {
+  unsigned long offset; // from the start of the region
+  size_t size;
+} page_extent_t;
+
 // Define a structure to hold memory region information
 typedef struct {
   unsigned long start;
@@ -25,16 +36,29 @@ typedef struct {
   unsigned long offset;
   size_t size;
   char *content;
+  // Without extents, content holds the whole region. Otherwise it holds the
+  // extents back to back and the rest of the region are holes, never touched
+  // by the process.
+  size_t num_extents;
+  page_extent_t *extents;
+  // Offset in the image file of the contents of an anonymous region mapped
+  // from a checkpoint image, 0 otherwise. Its pages not touched since are
+  // not populated but still part of the region.
+  unsigned long image_offset;
+  bool huge_pages; // backed by transparent huge pages
 } memory_region_t;
 
 typedef struct {
   size_t num_regions;
   memory_region_t *regions;
+  // the image file the regions are mapped from when restored from one
+  const char *image_path;
 } memory_dump_t;
 
 // Define a structure to hold the entire process state
 typedef struct {
-  struct user user_dump;
+  size_t num_threads;
+  cpu_state_t *cpu_states; // the thread-group leader first
   memory_dump_t memory_dump;
 } process_dump_t;
 
@@ -42,16 +66,53 @@ typedef struct {
 // We skip device mappings, vsyscall, vvar, vdso.
 bool should_save_region(const memory_region_t *region);
 
-// Function to read one memory region from /proc/<pid>/mem and save it to
-// region.content
-int get_memory_area(memory_region_t *region, const char *mem_path);
+// Function to check if the content of a memory region has to be transferred,
+// i.e. it is saved and not file-backed
+bool should_save_content(const memory_region_t *region);
 
-// Function to read memory regions from /proc/<pid>/maps and /proc/<pid>/mem
+// Function to read memory regions from /proc/<pid>/maps. Their contents are
+// streamed from the process rather than held in the dump.
 int read_memory_regions(pid_t pid, memory_dump_t *dump);
 
-int read_user_info(pid_t pid, struct user *user_dump);
-
 // Function to free the memory allocated in the dump
 void free_process_dump(process_dump_t *dump);
 
+void free_memory_dump(memory_dump_t *dump);
+
+// Pre-copy defaults: stop iterating after this many rounds, or as soon as a
+// round finds at most this many dirty pages
+#define PRECOPY_MAX_ROUNDS 8
+#define PRECOPY_DIRTY_THRESHOLD 256
+
+// Fleet drain defaults: migrations run at once, and at most
+#define DRAIN_WORKERS 4
+#define DRAIN_MAX_WORKERS 64
+
+// With pre-copy, the fleet is ordered by the pages each process writes over
+// this interval rather than by its populated pages
+#define DRAIN_DIRTY_INTERVAL_MS 100
+
+// Mount point of the cgroup2 hierarchy, the root of relative cgroup paths
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// Function to collect the runs of pages whose pagemap entry has any of the bits
+// of mask set in the regions of layout whose content is saved
+int collect_page_runs(pid_t pid, const memory_dump_t *layout, uint64_t mask,
+                      page_runs_t *runs);
+
+// Function to collect the runs of pages written since the last
+// clear_soft_dirty() in the regions of layout whose content is saved
+int collect_dirty_pages(pid_t pid, const memory_dump_t *layout,
+                        page_runs_t *runs);
+
+// Function to iteratively copy the memory of the running process before it is
+// stopped for the final round
+int precopy(pid_t pid, const streams_t *streams, int max_rounds,
+            size_t dirty_threshold);
+
+// Function to serve the pages of the stopped process to the destination after
+// it restored the process in post-copy mode: pages are pushed in the
+// background while page faults are answered first
+int postcopy_serve(pid_t pid, int socket_fd, const memory_dump_t *layout);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Compression levels: 1 is the fastest, higher levels search more match
+// candidates for a better ratio
+#define COMPRESS_LEVEL_FAST 1
+#define COMPRESS_LEVEL_MAX 9
+
+// Maximum size of the compressed form of len bytes
+#define COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Function to compress len bytes of src into dst, an LZ4-like block of
+// literal runs and back-references within the previous 64 KiB. Returns the
+// compressed size, or 0 if it does not fit in cap bytes.
+size_t compress_block(const char *src, size_t len, char *dst, size_t cap,
+                      int level);
+
+// Function to decompress a block into exactly len bytes of dst
+int decompress_block(const char *src, size_t compressed_len, char *dst,
+                     size_t len);
+
+// Adaptive compression of the page records sent by one thread. Compression is
+// skipped for a while after incompressible records, or when compressing costs
+// more time than it saves on the link.
+typedef struct {
+  int level; // 0 disables compression
+  char *buf;
+  size_t buf_size;
+  size_t link_bytes;           // bytes sent so far
+  long long link_ns;           // time spent sending them
+  double link_ns_per_byte;     // average send time
+  double compress_ns_per_byte; // moving average of the compression time
+  unsigned skip;               // records to send raw before trying again
+  unsigned backoff;            // next value of skip
+} compressor_t;
+
+int compressor_init(compressor_t *compressor, int level, size_t max_size);
+
+void compressor_free(compressor_t *compressor);
+
+// Function to compress size bytes of content into compressor->buf if it is
+// worth it. Returns the compressed size, or 0 to send the content raw.
+size_t compressor_try(compressor_t *compressor, const char *content,
+                      size_t size);
+
+// Function to account for the time taken to send bytes
+void compressor_account_link(compressor_t *compressor, size_t bytes,
+                             long long ns);
+
+// Function to print how much the page contents were compressed
+void compress_report(void);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "checkpoint.h"
+#include "pagemap.h"
+
+// An image file holds a stopped process, to be restored later. All integers
+// are little-endian. The header is followed by the index: the registers of
+// each thread as in the layout on the wire, the region records, the extent
+// records and the string table. The contents start at data_offset, on a page
+// boundary: each region's extents are stored back to back from the
+// page-aligned data_offset of its record, so they can be mapped from the file.
+// Zero pages are left as holes of the file.
+#define IMAGE_MAGIC 0x494d4c50 // "PLMI"
+#define IMAGE_VERSION 2
+
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t regs_size;
+  uint32_t num_threads;
+  uint32_t xstate_size;
+  uint32_t num_regions;
+  uint32_t num_extents;
+  uint32_t strtab_size;
+  uint32_t index_checksum; // of the index
+  uint64_t data_offset;
+  uint64_t file_size;
+  uint32_t checksum; // of the fields above
+} image_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  uint32_t path; // offset of the NUL-terminated path in the string table
+  char permissions[4];
+  uint64_t data_offset; // of the contents of the extents in the file
+  uint32_t first_extent;
+  uint32_t num_extents;
+  uint32_t flags; // WIRE_REGION_*
+} image_region_t;
+
+// A run of populated pages of a region
+typedef struct __attribute__((packed)) {
+  uint64_t offset; // from the start of the region
+  uint64_t size;
+} image_extent_t;
+
+// Size of the chunks of pages read from the process to write the image
+#define IMAGE_CHUNK_SIZE (256 * PAGE_SIZE)
+
+// Function to check if the file at path is a checkpoint image
+bool is_image_file(const char *path);
+
+// Function to write a stopped process to an image file: the registers and
+// layout of dump, and the populated pages in runs read from the process
+int write_image(const char *path, pid_t pid, const process_dump_t *dump,
+                const page_runs_t *runs);
+
+// Function to load an image file into dump. The contents are not copied: the
+// file is mapped privately and the regions point into the mapping. They also
+// record where their contents are in the file for krestore to map them from
+// path, which must outlive dump.
+int load_image(const char *path, process_dump_t *dump);
+
+#endif
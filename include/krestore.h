@@ -0,0 +1,54 @@
+#ifndef KRESTORE_H
+#define KRESTORE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// Interface of the krestore module, mirrored in src/kernel_vd/krestore.h.
+// The memory of a process is restored with a sequence of ioctls made by the
+// process itself: KRESTORE_BEGIN unmaps its memory, then each KRESTORE_MAP
+// maps a batch of regions of the restored layout, KRESTORE_FILL copies
+// contents into them and KRESTORE_COMMIT ends the restore.
+#define KRESTORE_DEVICE "/dev/krestore_mapping"
+
+// Size of the scratch area of the process being restored, the only mapping of
+// its own KRESTORE_BEGIN keeps. The restorer runs the following system calls
+// from a syscall instruction at its start and puts their arguments after it.
+#define KRESTORE_SCRATCH_SIZE (256 * 1024)
+
+// Flags of a region
+#define KRESTORE_REGION_STACK (1U << 0)      // grows down
+#define KRESTORE_REGION_HUGE_PAGES (1U << 1) // backed by transparent huge pages
+
+// A region of the restored layout
+typedef struct {
+  uint64_t start;
+  uint64_t size;
+  uint64_t offset; // in the file
+  uint64_t path;   // address of the path of the file, 0 if anonymous
+  uint32_t prot;   // PROT_*
+  uint32_t flags;  // KRESTORE_REGION_*
+} krestore_region_t;
+
+// Regions mapped with one KRESTORE_MAP, in order. Adjacent anonymous regions
+// with the same protections and flags are mapped together.
+typedef struct {
+  uint64_t regions; // address of the krestore_region_t records
+  uint64_t num_regions;
+} krestore_map_t;
+
+// Contents copied from src to dst, both addresses of the restored process
+typedef struct {
+  uint64_t dst;
+  uint64_t src;
+  uint64_t size;
+} krestore_fill_t;
+
+#define KRESTORE_IOC_MAGIC 'k'
+// The argument is the address of the scratch area
+#define KRESTORE_BEGIN _IO(KRESTORE_IOC_MAGIC, 1)
+#define KRESTORE_MAP _IOW(KRESTORE_IOC_MAGIC, 2, krestore_map_t)
+#define KRESTORE_FILL _IOW(KRESTORE_IOC_MAGIC, 3, krestore_fill_t)
+#define KRESTORE_COMMIT _IO(KRESTORE_IOC_MAGIC, 4)
+
+#endif
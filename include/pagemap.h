@@ -0,0 +1,60 @@
+#ifndef PAGEMAP_H
+#define PAGEMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+// Bits of a /proc/<pid>/pagemap entry.
+// See https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+
+// Size of a PMD-mapped transparent huge page
+#define HUGE_PAGE_SIZE (512 * PAGE_SIZE)
+
+// Number of pagemap entries fetched with one pread
+#define PAGEMAP_BATCH 4096
+
+// A run of consecutive pages [start, end)
+typedef struct {
+  unsigned long start;
+  unsigned long end;
+} page_run_t;
+
+typedef struct {
+  page_run_t *runs;
+  size_t num_runs;
+  size_t capacity;
+  size_t num_pages; // total number of pages in the runs
+} page_runs_t;
+
+// Function to open /proc/<pid>/pagemap for reading
+int open_pagemap(pid_t pid);
+
+// Function to read the pagemap entries of num_pages pages starting at the
+// page-aligned virtual address start
+int read_pagemap(int pagemap_fd, unsigned long start, size_t num_pages,
+                 uint64_t *entries);
+
+// Function to append the run of pages [start, end) to runs, merged with the
+// last run if contiguous. The caller accounts for its pages.
+int append_page_run(page_runs_t *runs, unsigned long start, unsigned long end);
+
+// Function to append to runs the runs of pages in [start, end) whose pagemap
+// entry has any of the bits of mask set
+int find_page_runs(int pagemap_fd, unsigned long start, unsigned long end,
+                   uint64_t mask, page_runs_t *runs);
+
+void free_page_runs(page_runs_t *runs);
+
+// Function to clear the soft-dirty bits of all pages of the process, so that
+// only pages written afterwards are reported as dirty in the pagemap
+int clear_soft_dirty(pid_t pid);
+
+// Function to check if the kernel tracks soft-dirty pages
+bool soft_dirty_supported(void);
+
+#endif
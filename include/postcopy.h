@@ -0,0 +1,39 @@
+#ifndef POSTCOPY_H
+#define POSTCOPY_H
+
+#include <stddef.h>
+#include <sys/user.h>
+
+// Page request telling the source that every page has arrived
+#define POSTCOPY_DONE 0UL
+
+// Size of the page records pushed in the background by the source
+#define POSTCOPY_CHUNK_SIZE (16 * PAGE_SIZE)
+
+// Function to create a userfaultfd for the memory of the calling process
+int uffd_create(void);
+
+// Function to pass a file descriptor over a unix socket
+int send_fd(int unix_fd, int fd);
+
+// Function to receive a file descriptor from a unix socket
+int recv_fd(int unix_fd);
+
+// Function to report the missing pages of a region through the userfaultfd
+int uffd_register_region(int uffd, unsigned long start, size_t size);
+
+int uffd_unregister_region(int uffd, unsigned long start, size_t size);
+
+// Function to atomically fill missing pages, skipping the ones that are
+// already present
+int uffd_copy(int uffd, unsigned long start, const char *content, size_t size);
+
+// Function to map zero pages where pages are missing
+int uffd_zeropage(int uffd, unsigned long start, size_t size);
+
+// Function to resolve the page faults of the restored process: faulting
+// pages are requested from the source while the pages it pushes in the
+// background are filled in, until the source has sent every page
+int handle_page_faults(int uffd, int socket_fd);
+
+#endif
@@ -1,11 +1,72 @@
+#ifndef PTRACE_H
+#define PTRACE_H
+
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/user.h>
 #include <sys/wait.h>
 
-// Function to attach to the target process
-int attach_process(pid_t pid);
+// Upper bound of the XSAVE area of the CPU, the kernel reports the actual size
+#define XSTATE_MAX_SIZE 16384
+
+// Register state of a thread, as exposed by the PTRACE_GETREGSET regsets. The
+// fields up to the XSAVE area are contiguous and sent as they are.
+typedef struct {
+  struct user_regs_struct regs;     // NT_PRSTATUS, with the fs and gs bases
+  struct user_fpregs_struct fpregs; // NT_PRFPREG, x87 and SSE
+  uint64_t sigmask;                 // blocked signals
+  uint8_t xstate[XSTATE_MAX_SIZE];  // NT_X86_XSTATE, AVX and later
+  size_t xstate_size;               // 0 if the kernel has no XSAVE regset
+} cpu_state_t;
+
+// Threads of a traced process, the thread-group leader first
+typedef struct {
+  pid_t *tids;
+  int *signals; // signal a thread stopped with, delivered again on detach
+  size_t num_threads;
+  size_t capacity;
+  uint64_t freeze_start_ns; // CLOCK_MONOTONIC time the stop was requested
+  uint64_t freeze_end_ns;   // and the last thread stopped
+} threads_t;
+
+// Function to attach to all threads of the target process without stopping
+// them. A seized thread that receives a signal waits for the tracer, so it
+// should be frozen or detached shortly after.
+int seize_process(pid_t pid, threads_t *threads);
+
+// Function to stop all seized threads of the target process, and the threads
+// it created since it was seized
+int freeze_process(pid_t pid, threads_t *threads);
+
+// Function to resume and detach from all threads of the traced process
+int detach_process(threads_t *threads);
+
+// Function to add a thread to the list
+int append_thread(threads_t *threads, pid_t tid);
+
+void free_threads(threads_t *threads);
+
+// Function to read the CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns(void);
+
+// Function to read the general purpose, FPU and extended registers and the
+// signal mask of a stopped tracee. A thread stopped in a system call is set
+// to run it again.
+int get_cpu_state(pid_t pid, cpu_state_t *state);
+
+// Function to write back the registers read by get_cpu_state. The extended
+// state falls back to x87/SSE only if the CPU has another XSAVE layout.
+int set_cpu_state(pid_t pid, const cpu_state_t *state);
+
+// Function to make a tracee stopped at a system call exit run the system call
+// nr from the syscall instruction at stub, in a tracee traced with
+// PTRACE_O_TRACESYSGOOD. Its return value, a negative errno on failure, is
+// stored in result.
+int inject_syscall(pid_t pid, unsigned long stub, long nr,
+                   const unsigned long args[6], long *result);
 
-// Function to detach from the target process
-int detach_process(pid_t pid);
+#endif
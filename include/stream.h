@@ -0,0 +1,63 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "pagemap.h"
+#include "xbzrle.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Size of one chunk buffer of the ring, a huge page so that the pages of a
+// huge page frame are read and sent together
+#define STREAM_CHUNK_SIZE HUGE_PAGE_SIZE
+
+// Default bound of the page data held by the checkpointer at any time
+#define STREAM_MEMORY_BUDGET (16 << 20)
+
+// Pool of page-aligned chunk buffers, reused by all the rounds of a
+// migration. Buffers are allocated on demand, at most max_buffers of them:
+// the chunks read ahead of the senders and one compression buffer per
+// stream when compressing.
+typedef struct {
+  char **free_bufs;
+  size_t num_free;
+  size_t num_allocated;
+  size_t max_buffers;
+} buffer_pool_t;
+
+// Function to create a pool of at most budget bytes of chunk buffers
+int buffer_pool_init(buffer_pool_t *pool, size_t budget);
+
+// Function to take a buffer from the pool, allocated if none is free. Returns
+// NULL once the budget is exhausted.
+char *buffer_pool_get(buffer_pool_t *pool);
+
+// Function to give a buffer back to the pool
+void buffer_pool_put(buffer_pool_t *pool, char *buf);
+
+void buffer_pool_free(buffer_pool_t *pool);
+
+// The connections the pages are sent over
+typedef struct {
+  const int *socket_fds;
+  int num_streams;
+  int compress_level; // 0 disables compression
+  page_cache_t *cache; // pages sent, NULL if pages are not sent as deltas
+  buffer_pool_t *pool; // the chunk buffers
+} streams_t;
+
+// Function to get the number of chunk buffers a migration over streams needs
+// at least: one in flight per stream, and its compression buffer
+size_t stream_min_buffers(int num_streams, int compress_level);
+
+// Function to send the pages of runs as page records over the streams, then
+// end the round on each of them. A reader thread fills the
+// chunk buffers of a bounded ring from the target while one sender thread per
+// socket compresses and sends the chunks already read, each taking the next
+// ready chunk so that faster streams carry more of them. The ring takes its
+// buffers from the pool of streams and gives them back.
+int stream_pages(pid_t pid, const page_runs_t *runs, const streams_t *streams,
+                 bool last_round, size_t *sent_bytes);
+
+#endif
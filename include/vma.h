@@ -0,0 +1,43 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Upper bounds of the table of mappings. The arenas are reserved with these
+// sizes but their pages are only populated as they are filled.
+#define VMA_TABLE_MAX_VMAS (1UL << 22)
+#define VMA_TABLE_MAX_STRINGS (64UL << 20)
+
+// A mapping of a process as listed in /proc/<pid>/maps
+typedef struct {
+  unsigned long start;
+  unsigned long end;
+  unsigned long offset;
+  uint32_t path;       // offset of the interned path in the strings
+  char permissions[4]; // e.g., "rwxp"
+} vma_t;
+
+// The mappings of a process in address order. Each path is stored once in
+// the strings, offset 0 is the empty path of anonymous mappings.
+typedef struct {
+  vma_t *vmas;
+  size_t num_vmas;
+  char *strings;
+  size_t strings_size;
+  uint32_t *slots; // hash table of the offsets of the interned paths
+  size_t num_slots;
+  size_t num_paths;
+} vma_table_t;
+
+// Function to read the mappings of a process from /proc/<pid>/maps. The file
+// is read in large blocks and parsed by hand.
+int read_vmas(pid_t pid, vma_table_t *table);
+
+// Function to get the path of a mapping, "" if anonymous
+const char *vma_path(const vma_table_t *table, const vma_t *vma);
+
+void free_vmas(vma_table_t *table);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "compress.h"
+#include "xbzrle.h"
+
+// All integers on the wire are little-endian. The structures below are sent
+// as they are, without padding.
+#define WIRE_MAGIC 0x574d4c50 // "PLMW"
+#define WIRE_VERSION 7
+
+// How the memory of the process is transferred, announced by the hello
+enum migration_mode {
+  MIGRATION_EAGER,    // all pages are sent before the process is restored
+  MIGRATION_POSTCOPY, // pages are fetched on demand after the restore
+};
+
+// First message on each connection
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t mode;
+  uint64_t migration; // same on all connections of a migration
+  uint16_t num_streams;
+  uint16_t stream; // index of this connection, 0 carries the layout
+  uint32_t checksum; // of the fields above
+} wire_hello_t;
+
+// Upper bound of the number of threads of a migrated process
+#define MAX_THREADS 4096
+
+// Header of the layout of the process, sent before its last round of pages so
+// that the destination maps the regions while they arrive. It is followed
+// by the registers of each thread, num_regions region records and the string
+// table. The registers of a thread are the first regs_size bytes of its
+// cpu_state_t then xstate_size bytes of its XSAVE area.
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t regs_size;
+  uint32_t num_threads;
+  uint32_t xstate_size;
+  uint32_t num_regions;
+  uint32_t strtab_size;
+  uint32_t payload_checksum; // of the registers, records and string table
+  uint32_t checksum;         // of the fields above
+} wire_layout_t;
+
+typedef struct __attribute__((packed)) {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  uint32_t path; // offset of the NUL-terminated path in the string table
+  char permissions[4];
+  uint32_t flags; // WIRE_REGION_*
+} wire_region_t;
+
+// Flag of a region backed by transparent huge pages
+#define WIRE_REGION_HUGE_PAGES (1U << 0)
+
+// Sent back by the destination on connection 0 once the process runs again
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint64_t restore_ns; // from the arrival of the last pages to the resume
+  uint32_t checksum;   // of the fields above
+} wire_resumed_t;
+
+// Function to compute the CRC-32 of len bytes, continuing from crc (0 to
+// start)
+uint32_t wire_checksum(uint32_t crc, const void *buf, size_t len);
+
+// A string table being built, zero-initialized to start. Each path is stored
+// once, an identical path is found through the hash table of the offsets.
+typedef struct {
+  char *strings;
+  size_t size;
+  size_t capacity;
+  uint32_t *slots; // offset + 1 of each string, 0 for a free slot
+  size_t num_slots;
+  size_t num_strings;
+} string_table_t;
+
+// Function to add path to the string table, reusing an identical path.
+// Returns the offset of the path in the table.
+long add_string(string_table_t *table, const char *path);
+
+void free_strings(string_table_t *table);
+
+// Function to send the hello of a connection
+int send_hello(int socket_fd, uint64_t migration, int mode, int num_streams,
+               int stream);
+
+// Function to check the hello received on a connection and decode it
+int check_hello(const wire_hello_t *hello, uint64_t *migration, int *mode,
+                int *num_streams, int *stream);
+
+// Function to tell the source that the process runs again
+int send_resumed(int socket_fd, uint64_t restore_ns);
+
+// Function to wait until the destination runs the process
+int recv_resumed(int socket_fd, uint64_t *restore_ns);
+
+// Function to send all the buffers of iov with as few syscalls as possible
+int writev_all(int socket_fd, struct iovec *iov, int iovcnt);
+
+// Function to send len bytes, looping over partial sends
+int send_all(int socket_fd, const void *buf, size_t len);
+
+// Function to get the number of bytes sent so far by send_all
+size_t wire_bytes_sent(void);
+
+// Function to receive len bytes, looping over partial receives
+int recv_all(int socket_fd, void *buf, size_t len);
+
+// Size flag of a page record covering only zero pages, no contents follow
+#define PAGE_RECORD_ZERO (1UL << 63)
+
+// Size flag of a page record whose contents are compressed: the compressed
+// size follows, then the compressed contents
+#define PAGE_RECORD_COMPRESSED (1UL << 62)
+
+// Size flag of a page record holding the delta of one page against the
+// contents last sent for it: the size of the delta follows, then the delta
+#define PAGE_RECORD_DELTA (1UL << 61)
+
+// Size of the pages covered by a page record
+#define PAGE_RECORD_SIZE(size)                                                 \
+  ((size) & ~(PAGE_RECORD_ZERO | PAGE_RECORD_COMPRESSED | PAGE_RECORD_DELTA))
+
+// How the contents of page records are encoded, NULL members are unused
+typedef struct {
+  compressor_t *compressor;
+  page_cache_t *cache; // pages already sent are sent as deltas
+} page_encoder_t;
+
+// Function to send page records: start address and size followed by the
+// page contents. Runs of zero pages are sent as PAGE_RECORD_ZERO records.
+// With an encoder, pages already sent are sent as deltas when smaller and the
+// others are compressed if it pays off.
+// An empty record (size 0) terminates a sequence of records.
+int send_pages(int socket_fd, unsigned long start, const char *content,
+               size_t size, const page_encoder_t *encoder);
+
+// Start of an empty record ending a round of page records when more rounds
+// follow. Pages of a round are spread over all the streams of the migration,
+// a page sent again in a later round must only be applied after the round.
+#define PAGE_RECORD_MORE_ROUNDS 1UL
+
+// Function to end a round of page records, last tells if it is the last round
+int send_round_end(int socket_fd, bool last);
+
+// Start of an empty record sent on every stream before the last round: the
+// layout follows on stream 0, and the pages of the last round are received
+// straight into the restored process
+#define PAGE_RECORD_LAYOUT 2UL
+
+// Function to announce the layout ahead of the last round
+int send_layout_next(int socket_fd);
+
+// Function to receive the header of a page record, the contents follow
+// unless PAGE_RECORD_ZERO is set in size
+int recv_page_header(int socket_fd, unsigned long *start, size_t *size);
+
+// Function to receive the contents of a page record with the given header
+// size into PAGE_RECORD_SIZE(size) bytes of content, decompressing them. For a
+// PAGE_RECORD_DELTA record content must hold the previous contents of the
+// page, the delta is applied onto them.
+int recv_page_content(int socket_fd, size_t size, char *content);
+
+// Default and maximum number of TCP connections the pages are spread over
+#define DEFAULT_STREAMS 1
+#define MAX_STREAMS 64
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef XBZRLE_H
+#define XBZRLE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/user.h>
+
+// Default memory budget of the cache of sent pages
+#define XBZRLE_CACHE_SIZE (64UL << 20)
+
+// A delta is only sent if it is smaller than this, else the whole page
+#define XBZRLE_MAX_DELTA (PAGE_SIZE / 2)
+
+// Function to encode the changes from old to new, both PAGE_SIZE bytes, as
+// runs of unchanged bytes and runs of new bytes. Returns the size of the
+// delta, or -1 if it does not fit in cap bytes.
+ssize_t xbzrle_encode(const char *old, const char *new, char *delta,
+                      size_t cap);
+
+// Function to apply a delta onto a page holding the old contents
+int xbzrle_decode(const char *delta, size_t len, char *page);
+
+typedef struct {
+  unsigned long addr;
+  int32_t hash_next; // next entry of the same bucket
+  int32_t lru_prev;  // more recently used entry
+  int32_t lru_next;  // less recently used entry, or next free entry
+} page_cache_entry_t;
+
+// Cache of the last contents sent of pages, by virtual address, with a
+// least-recently-used eviction once the budget is reached. Safe to use from
+// several threads.
+typedef struct {
+  size_t capacity; // in pages
+  size_t count;
+  char *data; // the contents of entry i at i * PAGE_SIZE
+  page_cache_entry_t *entries;
+  int32_t *buckets;
+  size_t num_buckets;
+  int32_t lru_head; // most recently used entry
+  int32_t lru_tail; // least recently used entry
+  int32_t free_list;
+  size_t num_lookups;
+  size_t num_deltas;
+  size_t delta_bytes;
+  pthread_mutex_t lock;
+} page_cache_t;
+
+int page_cache_init(page_cache_t *cache, size_t budget);
+
+void page_cache_free(page_cache_t *cache);
+
+// Function to encode a page against its cached contents, which are replaced
+// by page. Returns the size of the delta in delta, or -1 if the page is not
+// cached or its delta is larger than cap.
+ssize_t page_cache_encode(page_cache_t *cache, unsigned long addr,
+                          const char *page, char *delta, size_t cap);
+
+// Function to cache the contents sent of a page
+void page_cache_put(page_cache_t *cache, unsigned long addr, const char *page);
+
+// Function to forget a page, e.g. sent as a zero page
+void page_cache_drop(page_cache_t *cache, unsigned long addr);
+
+// Function to print how many re-sent pages were sent as deltas
+void page_cache_report(const page_cache_t *cache);
+
+#endif
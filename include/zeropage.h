@@ -0,0 +1,33 @@
+#ifndef ZEROPAGE_H
+#define ZEROPAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/user.h>
+
+// Function to check if a page only holds zeros. The scanner is picked at the
+// first call from the widest vector extension the CPU supports.
+bool is_zero_page(const char *page);
+
+// Name of the scanner in use: "avx2", "sse2" or "scalar"
+const char *zero_page_scanner(void);
+
+// A zero page scanner, e.g. to compare them
+typedef struct {
+  const char *name;
+  bool (*is_zero_page)(const char *page);
+} zero_page_scanner_t;
+
+#define ZERO_PAGE_MAX_SCANNERS 3
+
+// Function to list the scanners the CPU supports, widest first. Returns
+// their number, at most ZERO_PAGE_MAX_SCANNERS.
+size_t zero_page_scanners(zero_page_scanner_t *scanners);
+
+// Function to account for scanned pages, safe to call from several threads
+void zero_scan_account(size_t scanned_pages, size_t zero_pages, long long ns);
+
+// Function to print the number of zero pages found and the scan throughput
+void zero_scan_report(void);
+
+#endif
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Script to measure the restore daemon with several simultaneous migrations:
+# the aggregate throughput of the pages streamed and the p50/p99 downtime.
+# Usage: ./restore_bench.sh [counts...]   (default: 1 8 64)
+# CHECKPOINT, RESTORE, WORKLOAD and PORT override the binaries and the port,
+# CHECKPOINT_ARGS is passed to every checkpoint (e.g. "-p" for pre-copy).
+
+CHECKPOINT=${CHECKPOINT:-./build/checkpoint}
+RESTORE=${RESTORE:-./build/restore}
+WORKLOAD=${WORKLOAD:-./build/workload/kv}
+PORT=${PORT:-7000}
+counts=${*:-1 8 64}
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+printf "%-11s %-7s %-9s %-9s %-8s %-8s\n" migrations failed "wall ms" "MB/s" \
+    "p50 ms" "p99 ms"
+for n in $counts; do
+    # the daemon keeps a warm worker per migration, so that none waits for a
+    # fork
+    $RESTORE "$PORT" -w "$n" > "$out/restore.log" 2>&1 &
+    daemon=$!
+    pids=()
+    for i in $(seq 1 "$n"); do
+        $WORKLOAD > /dev/null &
+        pids+=($!)
+    done
+    sleep 1
+
+    start=$(date +%s%N)
+    checkpoints=()
+    for i in "${!pids[@]}"; do
+        $CHECKPOINT "${pids[$i]}" "127.0.0.1:$PORT" $CHECKPOINT_ARGS \
+            > "$out/$i.log" 2>&1 &
+        checkpoints+=($!)
+    done
+    failed=0
+    for checkpoint in "${checkpoints[@]}"; do
+        wait "$checkpoint" || failed=$((failed + 1))
+    done
+    wall_ns=$(($(date +%s%N) - start))
+
+    # the bytes of pages of each migration, in its last round for pre-copy
+    bytes=$(cat "$out"/[0-9]*.log |
+        sed -n 's/^\(Memory streamed\|Final round\): [0-9]* pages, \([0-9]*\) bytes.*/\2/p' |
+        awk '{sum += $1} END {print sum + 0}')
+    cat "$out"/[0-9]*.log | sed -n 's/^Downtime: \([0-9]*\) ns.*/\1/p' |
+        sort -n > "$out/downtimes"
+    # nearest-rank percentiles
+    percentile() {
+        awk -v p="$1" '{v[NR] = $1} END {
+            if (NR == 0) { print "-"; exit }
+            r = int(p * NR); if (r < p * NR) r++; if (r < 1) r = 1
+            printf "%.1f", v[r] / 1e6 }' "$out/downtimes"
+    }
+    printf "%-11s %-7s %-9s %-9s %-8s %-8s\n" "$n" "$failed" \
+        "$((wall_ns / 1000000))" \
+        "$(awk -v b="$bytes" -v t="$wall_ns" 'BEGIN {printf "%.1f", b * 1e3 / t}')" \
+        "$(percentile 0.5)" "$(percentile 0.99)"
+
+    # the restored processes are children of the daemon
+    pkill -KILL -P "$daemon"
+    kill -KILL "$daemon" "${pids[@]}" 2> /dev/null
+    wait 2> /dev/null
+    rm -f "$out"/*.log
+done
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE // process_vm_readv
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/user.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int open_mem(capture_t *capture) {
+  char mem_path[256];
+  snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", capture->pid);
+  capture->mem_fd = open(mem_path, O_RDONLY);
+  if (capture->mem_fd == -1) {
+    perror("open mem");
+    return -1;
+  }
+  return 0;
+}
+
+int capture_open(capture_t *capture, pid_t pid) {
+  capture->pid = pid;
+  capture->use_vm_readv = true;
+  capture->unreadable_pages = 0;
+  // the open checks the same access as process_vm_readv
+  return open_mem(capture);
+}
+
+void capture_close(capture_t *capture) {
+  if (capture->mem_fd != -1) {
+    close(capture->mem_fd);
+    capture->mem_fd = -1;
+  }
+  if (capture->unreadable_pages > 0) {
+    fprintf(stderr, "Capture: %zu unreadable pages zero-filled\n",
+            capture->unreadable_pages);
+  }
+}
+
+// Reads as much as possible from the ranges starting at index i, offset off,
+// and returns the number of bytes read. 0 means the first page is unreadable.
+static ssize_t read_batch(capture_t *capture, const struct iovec *local,
+                          const struct iovec *remote, size_t count, size_t i,
+                          size_t off) {
+  if (capture->use_vm_readv) {
+    struct iovec local_batch[IOV_MAX], remote_batch[IOV_MAX];
+    size_t n = 0;
+    for (; n < IOV_MAX && i + n < count; n++) {
+      size_t skip = n == 0 ? off : 0;
+      local_batch[n].iov_base = (char *)local[i + n].iov_base + skip;
+      local_batch[n].iov_len = local[i + n].iov_len - skip;
+      remote_batch[n].iov_base = (char *)remote[i + n].iov_base + skip;
+      remote_batch[n].iov_len = remote[i + n].iov_len - skip;
+    }
+    ssize_t ret = process_vm_readv(capture->pid, local_batch, n, remote_batch,
+                                   n, 0);
+    if (ret >= 0) {
+      return ret;
+    }
+    if (errno == EFAULT || errno == EIO) {
+      return 0;
+    }
+    if (errno != ENOSYS && errno != EPERM) {
+      perror("process_vm_readv");
+      return -1;
+    }
+    // not available to us, e.g. blocked by a seccomp policy
+    capture->use_vm_readv = false;
+  }
+
+  size_t len = remote[i].iov_len - off;
+  if (len > CAPTURE_CHUNK_SIZE) {
+    len = CAPTURE_CHUNK_SIZE;
+  }
+  ssize_t ret = pread(capture->mem_fd, (char *)local[i].iov_base + off, len,
+                      (unsigned long)remote[i].iov_base + off);
+  if (ret == -1 && errno != EIO && errno != EFAULT) {
+    perror("pread mem");
+    return -1;
+  }
+  return ret > 0 ? ret : 0;
+}
+
+int capture_read(capture_t *capture, const struct iovec *local,
+                 const struct iovec *remote, size_t count) {
+  size_t i = 0, off = 0; // cursor: range index and offset within it
+  while (i < count) {
+    if (off == remote[i].iov_len) {
+      i++;
+      off = 0;
+      continue;
+    }
+    ssize_t ret = read_batch(capture, local, remote, count, i, off);
+    if (ret == -1) {
+      return -1;
+    }
+
+    if (ret == 0) {
+      // the page at the cursor cannot be read with process_vm_readv, e.g.
+      // PROT_NONE: /proc/<pid>/mem still reads it, otherwise skip it
+      size_t len = remote[i].iov_len - off;
+      if (len > PAGE_SIZE) {
+        len = PAGE_SIZE;
+      }
+      char *dest = (char *)local[i].iov_base + off;
+      if (pread(capture->mem_fd, dest, len,
+                (unsigned long)remote[i].iov_base + off) != (ssize_t)len) {
+        memset(dest, 0, len);
+        capture->unreadable_pages++;
+      }
+      ret = len;
+    }
+
+    // advance the cursor by the bytes read
+    size_t advance = ret;
+    while (advance > 0 && i < count) {
+      size_t left = remote[i].iov_len - off;
+      if (advance < left) {
+        off += advance;
+        break;
+      }
+      advance -= left;
+      i++;
+      off = 0;
+    }
+  }
+  return 0;
+}
+
+int capture_read_range(capture_t *capture, char *buf, unsigned long start,
+                       size_t size) {
+  struct iovec local = {.iov_base = buf, .iov_len = size};
+  struct iovec remote = {.iov_base = (void *)start, .iov_len = size};
+  return capture_read(capture, &local, &remote, 1);
+}
@@ -1,65 +1,103 @@
 #include "checkpoint.h"
+#include "capture.h"
+#include "compress.h"
+#include "image.h"
+#include "pagemap.h"
+#include "postcopy.h"
 #include "ptrace.h"
+#include "stream.h"
+#include "vma.h"
+#include "wire.h"
+#include "zeropage.h"
 #include <arpa/inet.h>
+#include <endian.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 
-static long long get_time_ms() {
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  long long current_time = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-  return current_time;
-}
-
 int send_dump(process_dump_t *dump, int socket_fd) {
-  size_t total_send_bytes = 0;
-  // Send the user struct
-  if (send(socket_fd, &dump->user_dump, sizeof(struct user), 0) == -1) {
-    perror("send user_dump");
-    return -1;
-  }
-  total_send_bytes += sizeof(struct user);
+  // the memory contents were streamed before, in page records
+  size_t wire_bytes = wire_bytes_sent();
+  const memory_dump_t *memory_dump = &dump->memory_dump;
 
-  // Send the number of memory regions
-  if (send(socket_fd, &dump->memory_dump.num_regions, sizeof(size_t), 0) ==
-      -1) {
-    perror("send num_regions");
-    return -1;
+  // pack the region records, their paths go to the string table
+  wire_region_t *records = calloc(memory_dump->num_regions, sizeof(*records));
+  struct iovec *iov = calloc(dump->num_threads + 3, sizeof(*iov));
+  string_table_t strtab = {0};
+  int ret = 0;
+  if ((memory_dump->num_regions > 0 && !records) || !iov) {
+    perror("calloc region records");
+    ret = -1;
+    goto free;
   }
-  total_send_bytes += sizeof(size_t);
-
-  // Send each memory region
-  for (size_t i = 0; i < dump->memory_dump.num_regions; i++) {
-    memory_region_t *region = &dump->memory_dump.regions[i];
-
-    // Send the memory region metadata
-    if (send(socket_fd, &region->start, sizeof(region->start), 0) == -1 ||
-        send(socket_fd, &region->end, sizeof(region->end), 0) == -1 ||
-        send(socket_fd, &region->size, sizeof(region->size), 0) == -1 ||
-        send(socket_fd, &region->offset, sizeof(region->offset), 0) == -1 ||
-        send(socket_fd, region->permissions, sizeof(region->permissions), 0) ==
-            -1 ||
-        send(socket_fd, region->path, sizeof(region->path), 0) == -1) {
-      perror("send region metadata");
-      return -1;
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    long path = add_string(&strtab, region->path);
+    if (path == -1) {
+      ret = -1;
+      goto free;
     }
-    total_send_bytes += sizeof(region->start) + sizeof(region->end) +
-                        sizeof(region->size) + sizeof(region->offset) +
-                        sizeof(region->permissions) + sizeof(region->path);
+    records[i].start = htole64(region->start);
+    records[i].end = htole64(region->end);
+    records[i].offset = htole64(region->offset);
+    records[i].path = htole32(path);
+    memcpy(records[i].permissions, region->permissions,
+           sizeof(records[i].permissions));
+    records[i].flags =
+        htole32(region->huge_pages ? WIRE_REGION_HUGE_PAGES : 0);
+  }
 
-    // Send the memory content
-    if (region->size > 0 && region->content) {
-      if (send(socket_fd, region->content, region->size, 0) == -1) {
-        perror("send region content");
-        return -1;
-      }
-      total_send_bytes += region->size;
-    }
+  // the threads have the same XSAVE layout
+  size_t xstate_size = dump->cpu_states[0].xstate_size;
+  size_t state_size = offsetof(cpu_state_t, xstate) + xstate_size;
+  wire_layout_t layout = {
+      .magic = htole32(WIRE_MAGIC),
+      .version = htole16(WIRE_VERSION),
+      .regs_size = htole16(offsetof(cpu_state_t, xstate)),
+      .num_threads = htole32(dump->num_threads),
+      .xstate_size = htole32(xstate_size),
+      .num_regions = htole32(memory_dump->num_regions),
+      .strtab_size = htole32(strtab.size),
+  };
+  size_t records_size = memory_dump->num_regions * sizeof(*records);
+  uint32_t payload_checksum = 0;
+  for (size_t i = 0; i < dump->num_threads; i++) {
+    payload_checksum =
+        wire_checksum(payload_checksum, &dump->cpu_states[i], state_size);
   }
+  payload_checksum = wire_checksum(payload_checksum, records, records_size);
+  payload_checksum =
+      wire_checksum(payload_checksum, strtab.strings, strtab.size);
+  layout.payload_checksum = htole32(payload_checksum);
+  layout.checksum =
+      htole32(wire_checksum(0, &layout, offsetof(wire_layout_t, checksum)));
 
-  printf("Dump sent: %zu bytes\n", total_send_bytes);
+  // the whole layout goes out in one syscall
+  int iovcnt = 0;
+  iov[iovcnt++] =
+      (struct iovec){.iov_base = &layout, .iov_len = sizeof(layout)};
+  for (size_t i = 0; i < dump->num_threads; i++) {
+    iov[iovcnt++] = (struct iovec){.iov_base = &dump->cpu_states[i],
+                                   .iov_len = state_size};
+  }
+  iov[iovcnt++] = (struct iovec){.iov_base = records, .iov_len = records_size};
+  iov[iovcnt++] =
+      (struct iovec){.iov_base = strtab.strings, .iov_len = strtab.size};
+  if (writev_all(socket_fd, iov, iovcnt) == -1) {
+    perror("send layout");
+    ret = -1;
+    goto free;
+  }
+  printf("Dump sent: %zu threads, %zu regions in %zu bytes\n",
+         dump->num_threads, memory_dump->num_regions,
+         wire_bytes_sent() - wire_bytes);
 
-  return 0;
+free:
+  free(records);
+  free(iov);
+  free_strings(&strtab);
+  return ret;
 }
 
 bool should_save_region(const memory_region_t *region) {
@@ -75,224 +113,1087 @@ bool should_save_region(const memory_region_t *region) {
   return true;
 }
 
-int get_memory_area(memory_region_t *region, const char *mem_path) {
-  // Read the memory content
-  region->content = malloc(region->size);
-  if (!region->content) {
-    perror("malloc region.content");
-    return -1;
+bool should_save_content(const memory_region_t *region) {
+  // file-backed regions are mapped again from the file on restore
+  if (strlen(region->path) > 0 && strstr(region->path, "/") != NULL)
+    return false;
+
+  return should_save_region(region);
+}
+
+// Function to append to runs the pages of region whose pagemap entry has any
+// of the bits of mask set. All the pages of a region mapped from an image
+// count as populated: the ones not touched yet are only in the file.
+static int find_region_pages(int pagemap_fd, const memory_region_t *region,
+                             uint64_t mask, page_runs_t *runs) {
+  if (region->image_offset != 0 && (mask & PAGEMAP_PRESENT)) {
+    runs->num_pages += region->size / PAGE_SIZE;
+    return append_page_run(runs, region->start, region->end);
   }
+  return find_page_runs(pagemap_fd, region->start, region->end, mask, runs);
+}
 
-  int mem_fd = open(mem_path, O_RDONLY);
-  if (mem_fd == -1) {
-    perror("open mem");
-    free(region->content);
-    region->content = NULL;
-    return -1;
+// Function to flag the regions of dump that hold transparent huge pages, as
+// reported by /proc/<pid>/smaps
+static int read_huge_pages(pid_t pid, memory_dump_t *dump) {
+  // the totals tell if there are huge pages at all, without a record per
+  // mapping
+  char smaps_path[256];
+  snprintf(smaps_path, sizeof(smaps_path), "/proc/%d/smaps_rollup", pid);
+  FILE *smaps_file = fopen(smaps_path, "r");
+  if (smaps_file) {
+    unsigned long huge_kb = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), smaps_file) &&
+           sscanf(line, "AnonHugePages: %lu kB", &huge_kb) != 1) {
+    }
+    fclose(smaps_file);
+    if (huge_kb == 0) {
+      return 0;
+    }
   }
 
-  ssize_t bytes_read =
-      pread(mem_fd, region->content, region->size, region->start);
-  if (bytes_read != (ssize_t)region->size) {
-    // It's common that some memory regions cannot be read entirely
-    // due to permissions, so we handle partial reads or errors gracefully
-    perror("pread");
-    free(region->content);
-    region->content = NULL;
-    close(mem_fd);
+  snprintf(smaps_path, sizeof(smaps_path), "/proc/%d/smaps", pid);
+  smaps_file = fopen(smaps_path, "r");
+  if (!smaps_file) {
+    perror("fopen smaps");
     return -1;
   }
-  close(mem_fd);
+
+  // each mapping starts with its line of the maps, followed by its fields
+  memory_region_t *region = NULL;
+  size_t i = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), smaps_file)) {
+    unsigned long start, end, huge_kb;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      while (i < dump->num_regions && dump->regions[i].start < start) {
+        i++;
+      }
+      region = i < dump->num_regions && dump->regions[i].start == start
+                   ? &dump->regions[i]
+                   : NULL;
+    } else if (region &&
+               sscanf(line, "AnonHugePages: %lu kB", &huge_kb) == 1) {
+      region->huge_pages = huge_kb > 0;
+    }
+  }
+  fclose(smaps_file);
   return 0;
 }
 
-int read_memory_region(const char *line, memory_region_t *region,
-                       const char *mem_path) {
-  // Format: start_addr-end_addr perms offset dev inode pathname
-  char dev[12];
-  unsigned long inode;
-  int items_parsed = sscanf(line, "%lx-%lx %4s %lx %11s %lu %255[^\n]",
-                            &region->start, &region->end, region->permissions,
-                            &region->offset, dev, &inode, region->path);
-  if (items_parsed < 6) {
-    fprintf(stderr, "Failed to parse line: %s\n", line);
+int read_memory_regions(pid_t pid, memory_dump_t *dump) {
+  // See https://man7.org/linux/man-pages/man5/proc_pid_maps.5.html
+  vma_table_t table;
+  if (read_vmas(pid, &table) == -1) {
     return -1;
   }
-  if (items_parsed < 7) {
-    strcpy(region->path, "");
+  dump->regions = calloc(table.num_vmas, sizeof(memory_region_t));
+  if (table.num_vmas > 0 && !dump->regions) {
+    perror("calloc regions");
+    free_vmas(&table);
+    return -1;
   }
+  dump->num_regions = table.num_vmas;
+  dump->image_path = NULL;
 
-  region->size = region->end - region->start;
+  // the paths are interned, each file is checked once
+  uint32_t last_file = 0;
+  bool last_is_image = false;
+  for (size_t i = 0; i < table.num_vmas; i++) {
+    const vma_t *vma = &table.vmas[i];
+    memory_region_t *region = &dump->regions[i];
+    const char *path = vma_path(&table, vma);
+    region->start = vma->start;
+    region->end = vma->end;
+    region->size = vma->end - vma->start;
+    region->offset = vma->offset;
+    memcpy(region->permissions, vma->permissions, sizeof(vma->permissions));
+    // the paths longer than the region's are cut as by the maps parser
+    memcpy(region->path, path, strnlen(path, sizeof(region->path) - 1));
 
-  if (should_save_region(region)) {
-    if (strlen(region->path) > 0 && strstr(region->path, "/") != NULL) {
-      // if file-backed, don't save the content
-      region->content = NULL;
-    } else {
-      // anonymous memory, read the content
-      if (get_memory_area(region, mem_path) < 0) {
-        return -1;
+    // A process restored from an image maps its anonymous memory from the
+    // image file. It is still anonymous memory to be saved.
+    if (path[0] == '/') {
+      if (vma->path != last_file) {
+        last_file = vma->path;
+        last_is_image = is_image_file(path);
+      }
+      if (last_is_image) {
+        region->image_offset = region->offset;
+        region->offset = 0;
+        region->path[0] = '\0';
       }
     }
   }
-  return 0;
+  free_vmas(&table);
+
+  // huge pages are restored as huge pages
+  return read_huge_pages(pid, dump);
 }
 
-int read_memory_regions(pid_t pid, memory_dump_t *dump) {
-  char maps_path[256], mem_path[256];
-  snprintf(
-      maps_path, sizeof(maps_path), "/proc/%d/maps",
-      pid); // See https://man7.org/linux/man-pages/man5/proc_pid_maps.5.html
-  snprintf(mem_path, sizeof(mem_path), "/proc/%d/mem", pid);
-
-  FILE *maps_file = fopen(maps_path, "r");
-  if (!maps_file) {
-    perror("fopen maps");
+void free_memory_dump(memory_dump_t *dump) {
+  for (size_t i = 0; i < dump->num_regions; i++) {
+    free(dump->regions[i].content);
+    free(dump->regions[i].extents);
+  }
+  free(dump->regions);
+  dump->regions = NULL;
+  dump->num_regions = 0;
+}
+
+void free_process_dump(process_dump_t *dump) {
+  free(dump->cpu_states);
+  dump->cpu_states = NULL;
+  dump->num_threads = 0;
+  free_memory_dump(&dump->memory_dump);
+}
+
+int collect_page_runs(pid_t pid, const memory_dump_t *layout, uint64_t mask,
+                      page_runs_t *runs) {
+  int pagemap_fd = open_pagemap(pid);
+  if (pagemap_fd == -1) {
     return -1;
   }
 
-  // Initialize memory regions array
-  size_t regions_capacity = 20;
-  dump->regions = malloc(regions_capacity * sizeof(memory_region_t));
-  if (!dump->regions) {
-    perror("malloc");
-    fclose(maps_file);
+  memset(runs, 0, sizeof(*runs));
+  for (size_t i = 0; i < layout->num_regions; i++) {
+    const memory_region_t *region = &layout->regions[i];
+    if (should_save_content(region) &&
+        find_region_pages(pagemap_fd, region, mask, runs) == -1) {
+      free_page_runs(runs);
+      close(pagemap_fd);
+      return -1;
+    }
+  }
+  close(pagemap_fd);
+  return 0;
+}
+
+int collect_dirty_pages(pid_t pid, const memory_dump_t *layout,
+                        page_runs_t *runs) {
+  return collect_page_runs(pid, layout, PAGEMAP_SOFT_DIRTY, runs);
+}
+
+int precopy_round(pid_t pid, const streams_t *streams,
+                  size_t *num_dirty_pages) {
+  memory_dump_t layout;
+  page_runs_t runs;
+  memset(&layout, 0, sizeof(layout));
+  memset(&runs, 0, sizeof(runs));
+  threads_t threads;
+  int ret = 0;
+
+  // the target is stopped only while its dirty pages are collected and the
+  // soft-dirty bits are cleared, so that no write is lost in between
+  if (seize_process(pid, &threads) == -1 ||
+      freeze_process(pid, &threads) == -1) {
     return -1;
   }
-  dump->num_regions = 0;
+  if (read_memory_regions(pid, &layout) == -1 ||
+      collect_dirty_pages(pid, &layout, &runs) == -1 ||
+      clear_soft_dirty(pid) == -1) {
+    detach_process(&threads);
+    ret = -1;
+    goto ret;
+  }
+  *num_dirty_pages = runs.num_pages;
+  if (detach_process(&threads) == -1) {
+    ret = -1;
+    goto ret;
+  }
 
-  char line[512];
-  while (fgets(line, sizeof(line), maps_file)) {
-    memory_region_t region;
-    memset(&region, 0, sizeof(region));
+  // A running target may unmap a region between the scan and the read: its
+  // pages read as zeros and its new layout is picked up by a later round.
+  size_t sent_bytes = 0;
+  size_t wire_bytes = wire_bytes_sent();
+  if (stream_pages(pid, &runs, streams, false, &sent_bytes) == -1) {
+    ret = -1;
+    goto ret;
+  }
+  printf("Pre-copy round: %zu dirty pages, %zu bytes in %zu bytes\n",
+         *num_dirty_pages, sent_bytes, wire_bytes_sent() - wire_bytes);
+
+ret:
+  free_page_runs(&runs);
+  free_memory_dump(&layout);
+  return ret;
+}
+
+int precopy(pid_t pid, const streams_t *streams, int max_rounds,
+            size_t dirty_threshold) {
+  // round 0: copy all memory while the target keeps running
+  if (clear_soft_dirty(pid) == -1) {
+    return -1;
+  }
+  memory_dump_t layout;
+  page_runs_t runs;
+  memset(&layout, 0, sizeof(layout));
+  memset(&runs, 0, sizeof(runs));
+  size_t sent_bytes = 0;
+  int ret = 0;
+  if (read_memory_regions(pid, &layout) == -1 ||
+      collect_page_runs(pid, &layout, PAGEMAP_PRESENT | PAGEMAP_SWAPPED,
+                        &runs) == -1 ||
+      stream_pages(pid, &runs, streams, false, &sent_bytes) == -1) {
+    ret = -1;
+  }
+  free_page_runs(&runs);
+  free_memory_dump(&layout);
+  if (ret == -1) {
+    return -1;
+  }
+  printf("Pre-copy round 0: %zu bytes sent\n", sent_bytes);
 
-    if (read_memory_region(line, &region, mem_path) < 0) {
-      fclose(maps_file);
+  // following rounds: only send the pages written since the previous round,
+  // until the dirty set is small enough for the final stop-and-copy round
+  for (int round = 1; round <= max_rounds; round++) {
+    size_t num_dirty_pages;
+    if (precopy_round(pid, streams, &num_dirty_pages) == -1) {
       return -1;
     }
+    if (num_dirty_pages <= dirty_threshold) {
+      break;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  pid_t pid;
+  int socket_fd;
+  int pagemap_fd;
+  const memory_dump_t *layout;
+  pthread_mutex_t send_lock; // page records must not interleave
+  bool pushed_all;
+  size_t pushed_bytes;
+} postcopy_source_t;
 
-    // Add the region to the dump
-    if (dump->num_regions >= regions_capacity) {
-      regions_capacity *= 2;
-      memory_region_t *new_regions =
-          realloc(dump->regions, regions_capacity * sizeof(memory_region_t));
-      if (!new_regions) {
-        perror("realloc");
-        free(region.content);
+static void *push_pages(void *arg) {
+  postcopy_source_t *source = arg;
+  char *buf = malloc(POSTCOPY_CHUNK_SIZE);
+  if (!buf) {
+    perror("malloc push buffer");
+    return (void *)-1L;
+  }
+
+  // only populated pages are pushed, a fault on a hole is served on request
+  long ret = 0;
+  capture_t capture;
+  if (capture_open(&capture, source->pid) == -1) {
+    ret = -1;
+  }
+  page_runs_t runs;
+  memset(&runs, 0, sizeof(runs));
+  for (size_t i = 0; i < source->layout->num_regions && ret == 0; i++) {
+    const memory_region_t *region = &source->layout->regions[i];
+    if (should_save_content(region) &&
+        find_page_runs(source->pagemap_fd, region->start, region->end,
+                       PAGEMAP_PRESENT | PAGEMAP_SWAPPED, &runs) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  for (size_t i = 0; i < runs.num_runs && ret == 0; i++) {
+    const page_run_t *run = &runs.runs[i];
+    for (unsigned long addr = run->start; addr < run->end;
+         addr += POSTCOPY_CHUNK_SIZE) {
+      size_t len = run->end - addr;
+      if (len > POSTCOPY_CHUNK_SIZE) {
+        len = POSTCOPY_CHUNK_SIZE;
+      }
+      if (capture_read_range(&capture, buf, addr, len) == -1) {
+        ret = -1;
         break;
       }
-      dump->regions = new_regions;
+      pthread_mutex_lock(&source->send_lock);
+      ret = send_pages(source->socket_fd, addr, buf, len, NULL);
+      pthread_mutex_unlock(&source->send_lock);
+      if (ret == -1) {
+        break;
+      }
+      source->pushed_bytes += len;
     }
-    dump->regions[dump->num_regions++] = region;
   }
+  free_page_runs(&runs);
+  capture_close(&capture);
 
-  fclose(maps_file);
-  return 0;
+  // terminate the stream even on failure, so that the destination stops
+  pthread_mutex_lock(&source->send_lock);
+  if (send_pages(source->socket_fd, 0, NULL, 0, NULL) == -1) {
+    ret = -1;
+  }
+  source->pushed_all = true;
+  pthread_mutex_unlock(&source->send_lock);
+
+  free(buf);
+  return (void *)ret;
+}
+
+int postcopy_serve(pid_t pid, int socket_fd, const memory_dump_t *layout) {
+  postcopy_source_t source = {
+      .pid = pid,
+      .socket_fd = socket_fd,
+      .layout = layout,
+      .pushed_all = false,
+      .pushed_bytes = 0,
+  };
+  source.pagemap_fd = open_pagemap(pid);
+  if (source.pagemap_fd == -1) {
+    return -1;
+  }
+  pthread_mutex_init(&source.send_lock, NULL);
+
+  pthread_t pusher;
+  if (pthread_create(&pusher, NULL, push_pages, &source) != 0) {
+    perror("pthread_create");
+    close(source.pagemap_fd);
+    return -1;
+  }
+
+  // answer the page faults of the restored process until it has every page
+  int ret = 0;
+  size_t num_requests = 0;
+  char page[PAGE_SIZE];
+  capture_t capture;
+  if (capture_open(&capture, pid) == -1) {
+    ret = -1;
+  }
+  while (ret == 0) {
+    unsigned long addr;
+    if (recv_all(socket_fd, &addr, sizeof(addr)) == -1) {
+      perror("recv page request");
+      ret = -1;
+      break;
+    }
+    if (addr == POSTCOPY_DONE) {
+      break;
+    }
+    if (capture_read_range(&capture, page, addr, PAGE_SIZE) == -1) {
+      ret = -1;
+      break;
+    }
+    pthread_mutex_lock(&source.send_lock);
+    // once everything was pushed, pending requests are already satisfied
+    if (!source.pushed_all &&
+        send_pages(socket_fd, addr, page, PAGE_SIZE, NULL) == -1) {
+      ret = -1;
+    }
+    pthread_mutex_unlock(&source.send_lock);
+    if (ret == -1) {
+      break;
+    }
+    num_requests++;
+  }
+
+  // on failure, unblock the pusher
+  if (ret == -1) {
+    shutdown(socket_fd, SHUT_RDWR);
+  }
+  void *push_ret;
+  pthread_join(pusher, &push_ret);
+  if (push_ret != NULL) {
+    ret = -1;
+  }
+  printf("Post-copy: %zu page requests served, %zu bytes pushed\n",
+         num_requests, source.pushed_bytes);
+
+  capture_close(&capture);
+  pthread_mutex_destroy(&source.send_lock);
+  close(source.pagemap_fd);
+  return ret;
+}
+
+static int connect_stream(const struct sockaddr_in *server_addr) {
+  int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (socket_fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(socket_fd, (const struct sockaddr *)server_addr,
+              sizeof(*server_addr)) == -1) {
+    perror("connect");
+    close(socket_fd);
+    return -1;
+  }
+  return socket_fd;
+}
+
+// Function to print the peak memory use of the checkpointer, and that of the
+// chunk buffers when pages were streamed
+static void memory_report(const buffer_pool_t *pool) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1) {
+    perror("getrusage");
+    return;
+  }
+  printf("Peak RSS: %.1f MiB", usage.ru_maxrss / 1024.0);
+  if (pool) {
+    printf(", chunk buffers: %.1f MiB of a %.1f MiB budget",
+           pool->num_allocated * (double)STREAM_CHUNK_SIZE / (1 << 20),
+           pool->max_buffers * (double)STREAM_CHUNK_SIZE / (1 << 20));
+  }
+  printf("\n");
 }
 
-int read_user_info(pid_t pid, struct user *user_dump) {
-  // Calculate the size of the user struct
-  size_t user_struct_size = sizeof(struct user);
-  long data;
-  size_t i;
-  // Read the user struct word by word into the user_data struct
-  for (i = 0; i < user_struct_size / sizeof(long); i++) {
-    errno = 0;
-    data = ptrace(PTRACE_PEEKUSER, pid, sizeof(long) * i, NULL);
-    if (data == -1) {
-      perror("ptrace(PTRACE_PEEKUSER) failed");
+// Function to get the general purpose, FPU and vector registers of all the
+// frozen threads
+static int capture_registers(const threads_t *threads, process_dump_t *dump) {
+  uint64_t regs_start = get_time_ns();
+  dump->cpu_states = malloc(threads->num_threads * sizeof(cpu_state_t));
+  if (!dump->cpu_states) {
+    perror("malloc cpu states");
+    return -1;
+  }
+  dump->num_threads = threads->num_threads;
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (get_cpu_state(threads->tids[i], &dump->cpu_states[i]) == -1) {
       return -1;
     }
-    // Copy the data into the user_data struct
-    ((long *)user_dump)[i] = data;
   }
+  printf("Registers of %zu threads captured in %lu ns (%zu bytes of "
+         "xstate)\n",
+         dump->num_threads, get_time_ns() - regs_start,
+         dump->cpu_states[0].xstate_size);
   return 0;
 }
 
-void free_process_dump(process_dump_t *dump) {
-  for (size_t i = 0; i < dump->memory_dump.num_regions; i++) {
-    free(dump->memory_dump.regions[i].content);
+// Function to checkpoint the process to an image file instead of a
+// destination. The process is killed once the image is on disk, and keeps
+// running if the checkpoint fails.
+static int checkpoint_to_image(pid_t pid, const char *path) {
+  process_dump_t dump;
+  memset(&dump, 0, sizeof(dump));
+  page_runs_t runs;
+  memset(&runs, 0, sizeof(runs));
+  threads_t threads;
+  if (seize_process(pid, &threads) == -1) {
+    return -1;
+  }
+  if (freeze_process(pid, &threads) == -1) {
+    return -1;
   }
-  free(dump->memory_dump.regions);
-}
 
-int main(int argc, char *argv[]) {
-  int ret = 0;
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <pid> <ip:port>\n", argv[0]);
-    return EXIT_FAILURE;
+  int ret = -1;
+  if (read_memory_regions(pid, &dump.memory_dump) == -1 ||
+      capture_registers(&threads, &dump) == -1 ||
+      collect_page_runs(pid, &dump.memory_dump,
+                        PAGEMAP_PRESENT | PAGEMAP_SWAPPED, &runs) == -1 ||
+      write_image(path, pid, &dump, &runs) == -1) {
+    goto ret;
   }
+  printf("Checkpoint: process stopped for %lu ns\n",
+         get_time_ns() - threads.freeze_start_ns);
 
-  // Check if the target process exists
-  pid_t target_pid = atoi(argv[1]);
-  if (kill(target_pid, 0) == -1 && errno != EPERM) {
+  // kill the pid
+  if (kill(pid, SIGKILL) == -1) {
     perror("kill");
-    return EXIT_FAILURE;
+    goto ret;
   }
+  ret = 0;
 
-  // parse ip and port to socket address
-  char *send_socket = argv[2];
-  const char *ip = strtok(send_socket, ":");
-  const char *port = strtok(NULL, ":");
-  if (ip == NULL || port == NULL) {
-    fprintf(stderr, "Invalid ip:port\n");
-    return EXIT_FAILURE;
+ret:
+  if (ret == -1) {
+    detach_process(&threads);
   }
+  zero_scan_report();
+  memory_report(NULL);
+  free_page_runs(&runs);
+  free_process_dump(&dump);
+  free_threads(&threads);
+  return ret;
+}
+
+// Settings shared by the migrations of a run
+typedef struct {
   struct sockaddr_in server_addr;
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(atoi(port));
-  server_addr.sin_addr.s_addr = inet_addr(ip);
-  if (inet_pton(AF_INET, ip, &server_addr.sin_addr) != 1) {
-    perror("inet_pton");
-    return EXIT_FAILURE;
-  }
-  int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (socket_fd == -1) {
-    perror("socket");
-    return EXIT_FAILURE;
+  bool use_precopy;
+  bool use_postcopy;
+  int max_rounds;
+  size_t dirty_threshold;
+  int num_streams;
+  int compress_level;
+  size_t cache_size;
+} migrate_options_t;
+
+// Runs migrations one after the other, with its own chunk buffers. The
+// connections of an eager migration are kept for the next one: once the
+// process resumed, the destination waits for a new hello on them.
+typedef struct {
+  const migrate_options_t *options;
+  int socket_fds[MAX_STREAMS];
+  bool connected;
+  buffer_pool_t pool;
+} migrator_t;
+
+static void disconnect(migrator_t *migrator) {
+  if (!migrator->connected) {
+    return;
   }
-  if (connect(socket_fd, (struct sockaddr *)&server_addr,
-              sizeof(server_addr)) == -1) {
-    perror("connect");
-    return EXIT_FAILURE;
+  for (int i = 0; i < migrator->options->num_streams; i++) {
+    close(migrator->socket_fds[i]);
   }
+  migrator->connected = false;
+}
 
-  if (attach_process(target_pid) == -1) {
-    return EXIT_FAILURE;
+static int connect_streams(migrator_t *migrator) {
+  if (migrator->connected) {
+    return 0;
   }
-  long long start_time = get_time_ms();
-  printf("migration start time: %lld ms\n", start_time);
+  for (int i = 0; i < migrator->options->num_streams; i++) {
+    migrator->socket_fds[i] = connect_stream(&migrator->options->server_addr);
+    if (migrator->socket_fds[i] == -1) {
+      while (i-- > 0) {
+        close(migrator->socket_fds[i]);
+      }
+      return -1;
+    }
+  }
+  migrator->connected = true;
+  return 0;
+}
 
+// Function to migrate the process to the destination and kill it once it runs
+// there. A failure before the layout is sent leaves the process running here.
+// Once it is sent the destination may run the process, so a failure leaves it
+// stopped instead, or kills it once a post-copy destination runs it.
+static int migrate(migrator_t *migrator, pid_t target_pid,
+                   uint64_t *downtime_ns) {
+  const migrate_options_t *options = migrator->options;
+  bool use_precopy = options->use_precopy;
+  bool use_postcopy = options->use_postcopy;
+  int num_streams = options->num_streams;
+  page_cache_t cache;
+  memset(&cache, 0, sizeof(cache));
   process_dump_t dump;
   memset(&dump, 0, sizeof(dump));
+  threads_t threads;
+  memset(&threads, 0, sizeof(threads));
+  page_runs_t runs;
+  memset(&runs, 0, sizeof(runs));
+  bool sent_layout = false;
+  bool resumed = false;
+  int ret = -1;
 
-  // Read memory regions
-  if (read_memory_regions(target_pid, &dump.memory_dump) == -1) {
-    ret = -1;
+  // The first connection carries the control messages and the layout, the
+  // pages are spread over all of them. The destination may restore several
+  // processes at once, the id tells the connections of this one apart.
+  if (connect_streams(migrator) == -1) {
+    return -1;
+  }
+  const int *socket_fds = migrator->socket_fds;
+  int socket_fd = socket_fds[0];
+  uint64_t migration = ((uint64_t)target_pid << 32) ^ get_time_ns();
+  for (int i = 0; i < num_streams; i++) {
+    // tell the destination how the memory will be transferred
+    int mode = use_postcopy ? MIGRATION_POSTCOPY : MIGRATION_EAGER;
+    if (send_hello(socket_fds[i], migration, mode, num_streams, i) == -1) {
+      goto ret;
+    }
+  }
+  streams_t streams = {
+      .socket_fds = socket_fds,
+      .num_streams = num_streams,
+      .compress_level = options->compress_level,
+      .pool = &migrator->pool,
+  };
+
+  // pre-copy sends pages again, as deltas against the contents sent before
+  if (use_precopy && options->cache_size > 0) {
+    if (page_cache_init(&cache, options->cache_size) == -1) {
+      goto ret;
+    }
+    streams.cache = &cache;
+  }
+  if (use_precopy && precopy(target_pid, &streams, options->max_rounds,
+                             options->dirty_threshold) == -1) {
     goto ret;
   }
 
-  // get user registers
-  if (ptrace(PTRACE_GETREGS, target_pid, NULL, &dump.user_dump.regs) == -1) {
-    perror("ptrace(PTRACE_GETREGS)");
-    ret = -1;
+  // The threads are seized without stopping them, the freeze that starts the
+  // downtime only interrupts them
+  if (seize_process(target_pid, &threads) == -1 ||
+      freeze_process(target_pid, &threads) == -1) {
     goto ret;
   }
 
-  // Send the dump to the server
+  // Read the memory layout and send it ahead of the pages, so that the
+  // destination maps the regions while the pages are streamed from the stopped
+  // process: all populated pages, or after pre-copy only the pages dirtied
+  // since the last round. In post-copy mode the pages are sent once the
+  // process has been restored, the round is empty.
+  if (read_memory_regions(target_pid, &dump.memory_dump) == -1 ||
+      capture_registers(&threads, &dump) == -1) {
+    goto ret;
+  }
+  for (int i = 0; i < num_streams; i++) {
+    if (send_layout_next(socket_fds[i]) == -1) {
+      goto ret;
+    }
+  }
   if (send_dump(&dump, socket_fd) == -1) {
-    ret = -1;
+    goto ret;
+  }
+  sent_layout = true;
+  uint64_t mask =
+      use_precopy ? PAGEMAP_SOFT_DIRTY : PAGEMAP_PRESENT | PAGEMAP_SWAPPED;
+  if (!use_postcopy &&
+      collect_page_runs(target_pid, &dump.memory_dump, mask, &runs) == -1) {
+    goto ret;
+  }
+  size_t sent_bytes = 0;
+  size_t wire_bytes = wire_bytes_sent();
+  uint64_t stream_start = get_time_ns();
+  if (stream_pages(target_pid, &runs, &streams, true, &sent_bytes) == -1) {
+    goto ret;
+  }
+  double stream_ms = (get_time_ns() - stream_start) / 1e6;
+  if (!use_postcopy) {
+    printf("%s: %zu pages, %zu bytes in %zu bytes over %d streams in %.1f ms "
+           "(%.1f MB/s)\n",
+           use_precopy ? "Final round" : "Memory streamed", runs.num_pages,
+           sent_bytes, wire_bytes_sent() - wire_bytes, num_streams, stream_ms,
+           stream_ms > 0 ? sent_bytes / 1e3 / stream_ms : 0.0);
+  }
+
+  // The process is only killed once the destination runs it. The downtime
+  // spans from the freeze to the resume on the destination: its clock is not
+  // ours, so the transfer of the last pages is estimated as half the round
+  // trip left once the restore time it reports is taken out.
+  uint64_t state_sent = get_time_ns();
+  uint64_t restore_ns;
+  if (recv_resumed(socket_fd, &restore_ns) == -1) {
+    goto ret;
+  }
+  resumed = true;
+  uint64_t round_trip = get_time_ns() - state_sent;
+  uint64_t transfer_ns =
+      round_trip > restore_ns ? (round_trip - restore_ns) / 2 : 0;
+  *downtime_ns =
+      state_sent - threads.freeze_start_ns + transfer_ns + restore_ns;
+  printf("Downtime: %lu ns (stopping %lu ns, dump %lu ns, transfer ~%lu ns, "
+         "restore %lu ns)\n",
+         *downtime_ns, threads.freeze_end_ns - threads.freeze_start_ns,
+         state_sent - threads.freeze_end_ns, transfer_ns, restore_ns);
+
+  // Serve the pages of the stopped process until the destination has them all
+  if (use_postcopy &&
+      postcopy_serve(target_pid, socket_fd, &dump.memory_dump) == -1) {
     goto ret;
   }
 
   // kill the pid
   if (kill(target_pid, SIGKILL) == -1) {
     perror("kill");
-    ret = -1;
     goto ret;
   }
+  ret = 0;
 
 ret:
+  // The process must not run on both sides. Stopped, it stays so once
+  // detached, until the destination is known not to run it.
+  if (ret == -1 && resumed && use_postcopy) {
+    fprintf(stderr, "Post-copy of PID %d failed, killing it\n", target_pid);
+    kill(target_pid, SIGKILL);
+  } else if (ret == -1 && sent_layout) {
+    fprintf(stderr,
+            "Migration of PID %d failed, left stopped as it may run on the "
+            "destination\n",
+            target_pid);
+    kill(target_pid, SIGSTOP);
+  }
+  if (ret == -1) {
+    detach_process(&threads);
+  }
+  // a failed migration leaves the connections in an unknown state
+  if (ret == -1 || use_postcopy) {
+    disconnect(migrator);
+  }
+  page_cache_report(&cache);
+  page_cache_free(&cache);
+  free_page_runs(&runs);
   free_process_dump(&dump);
+  free_threads(&threads);
   return ret;
-}
\ No newline at end of file
+}
+
+// A process of the fleet being drained
+typedef struct {
+  pid_t pid;
+  size_t num_pages; // the pages its last round is expected to send
+  int ret;
+  uint64_t downtime_ns;
+  uint64_t elapsed_ns; // from the start of its migration to its end
+} drain_entry_t;
+
+// The processes to migrate, smallest first, taken in turn by the workers
+typedef struct {
+  drain_entry_t *entries;
+  size_t num_entries;
+  size_t next; // the next entry to migrate
+} drain_t;
+
+typedef struct {
+  drain_t *drain;
+  migrator_t migrator;
+  pthread_t thread;
+} drain_worker_t;
+
+static void *drain_worker(void *arg) {
+  drain_worker_t *worker = arg;
+  drain_t *drain = worker->drain;
+  while (1) {
+    size_t i = __atomic_fetch_add(&drain->next, 1, __ATOMIC_RELAXED);
+    if (i >= drain->num_entries) {
+      break;
+    }
+    drain_entry_t *entry = &drain->entries[i];
+    if (entry->ret == -1) {
+      continue;
+    }
+    uint64_t start = get_time_ns();
+    entry->ret = migrate(&worker->migrator, entry->pid, &entry->downtime_ns);
+    entry->elapsed_ns = get_time_ns() - start;
+  }
+  disconnect(&worker->migrator);
+  return NULL;
+}
+
+// Function to count the pages of the saved regions of the running process
+// whose pagemap entry has any of the bits of mask set
+static long count_pages(pid_t pid, uint64_t mask) {
+  memory_dump_t layout;
+  memset(&layout, 0, sizeof(layout));
+  page_runs_t runs;
+  memset(&runs, 0, sizeof(runs));
+  long num_pages = -1;
+  if (read_memory_regions(pid, &layout) == 0 &&
+      collect_page_runs(pid, &layout, mask, &runs) == 0) {
+    num_pages = runs.num_pages;
+  }
+  free_page_runs(&runs);
+  free_memory_dump(&layout);
+  return num_pages;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  const drain_entry_t *x = a, *y = b;
+  return (x->num_pages > y->num_pages) - (x->num_pages < y->num_pages);
+}
+
+// Function to migrate the processes with at most num_workers migrations at
+// once. The cheapest processes go first: the ones waiting for a worker stay
+// up, and the short migrations do not queue behind the long ones. Without
+// pre-copy the last round sends all populated pages, with pre-copy it sends
+// what is written while the rounds run, so the processes are ranked by the
+// pages they write over DRAIN_DIRTY_INTERVAL_MS.
+static int drain(const pid_t *pids, size_t num_pids, int num_workers,
+                 const migrate_options_t *options, size_t memory_budget) {
+  uint64_t drain_start = get_time_ns();
+  drain_t drain = {.num_entries = num_pids};
+  drain.entries = calloc(num_pids, sizeof(*drain.entries));
+  drain_worker_t *workers = calloc(num_workers, sizeof(*workers));
+  int ret = 0;
+  if (!drain.entries || !workers) {
+    perror("calloc drain");
+    free(drain.entries);
+    free(workers);
+    return -1;
+  }
+  bool rank_dirty = num_pids > 1 && options->use_precopy;
+  for (size_t i = 0; i < num_pids; i++) {
+    drain.entries[i].pid = pids[i];
+    if (rank_dirty && clear_soft_dirty(pids[i]) == -1) {
+      drain.entries[i].ret = -1;
+    }
+  }
+  if (rank_dirty) {
+    // one interval for the whole fleet
+    usleep(DRAIN_DIRTY_INTERVAL_MS * 1000);
+  }
+  uint64_t mask =
+      rank_dirty ? PAGEMAP_SOFT_DIRTY : PAGEMAP_PRESENT | PAGEMAP_SWAPPED;
+  for (size_t i = 0; i < num_pids; i++) {
+    drain_entry_t *entry = &drain.entries[i];
+    if (num_pids > 1 && entry->ret == 0) {
+      long num_pages = count_pages(pids[i], mask);
+      if (num_pages == -1) {
+        entry->ret = -1;
+        continue;
+      }
+      entry->num_pages = num_pages;
+    }
+  }
+  qsort(drain.entries, num_pids, sizeof(*drain.entries), compare_entries);
+
+  int num_started = 0;
+  for (; num_started < num_workers; num_started++) {
+    drain_worker_t *worker = &workers[num_started];
+    worker->drain = &drain;
+    worker->migrator.options = options;
+    if (buffer_pool_init(&worker->migrator.pool, memory_budget) == -1) {
+      ret = -1;
+      break;
+    }
+    if (pthread_create(&worker->thread, NULL, drain_worker, worker) != 0) {
+      perror("pthread_create");
+      buffer_pool_free(&worker->migrator.pool);
+      ret = -1;
+      break;
+    }
+  }
+  // the workers started take the whole fleet
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (num_started == 0) {
+    free(drain.entries);
+    free(workers);
+    return -1;
+  }
+
+  size_t num_migrated = 0;
+  for (size_t i = 0; i < num_pids; i++) {
+    if (drain.entries[i].ret == 0) {
+      num_migrated++;
+    }
+  }
+  if (num_pids > 1) {
+    printf("Drain: %zu of %zu processes migrated in %.1f ms with %d "
+           "workers\n",
+           num_migrated, num_pids, (get_time_ns() - drain_start) / 1e6,
+           num_started);
+    for (size_t i = 0; i < num_pids; i++) {
+      const drain_entry_t *entry = &drain.entries[i];
+      if (entry->ret == -1) {
+        printf("  PID %d: failed\n", entry->pid);
+        continue;
+      }
+      printf("  PID %d: %zu %spages, downtime %.2f ms, migrated in %.1f ms\n",
+             entry->pid, entry->num_pages, rank_dirty ? "dirty " : "",
+             entry->downtime_ns / 1e6, entry->elapsed_ns / 1e6);
+    }
+  }
+  memory_report(num_started == 1 ? &workers[0].migrator.pool : NULL);
+  for (int i = 0; i < num_started; i++) {
+    buffer_pool_free(&workers[i].migrator.pool);
+  }
+  free(drain.entries);
+  free(workers);
+  return num_migrated == num_pids ? ret : -1;
+}
+
+// Function to append pid to the processes to checkpoint, once it is known to
+// exist
+static int add_target(pid_t pid, pid_t **pids, size_t *num_pids,
+                      size_t *capacity) {
+  if (pid <= 0 || (kill(pid, 0) == -1 && errno != EPERM)) {
+    fprintf(stderr, "No process %d: %s\n", pid, strerror(errno));
+    return -1;
+  }
+  if (*num_pids == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    pid_t *new_pids = realloc(*pids, new_capacity * sizeof(**pids));
+    if (!new_pids) {
+      perror("realloc pids");
+      return -1;
+    }
+    *pids = new_pids;
+    *capacity = new_capacity;
+  }
+  (*pids)[(*num_pids)++] = pid;
+  return 0;
+}
+
+// Function to read the processes to checkpoint: a comma separated list of
+// pids, or a cgroup, relative to the cgroup2 mount unless absolute
+static int read_targets(const char *arg, pid_t **pids, size_t *num_pids) {
+  size_t capacity = 0;
+  *pids = NULL;
+  *num_pids = 0;
+  if (*arg >= '0' && *arg <= '9') {
+    const char *p = arg;
+    while (1) {
+      char *end;
+      pid_t pid = strtol(p, &end, 10);
+      if ((*end != ',' && *end != '\0') || end == p) {
+        fprintf(stderr, "Invalid pid list: %s\n", arg);
+        return -1;
+      }
+      if (add_target(pid, pids, num_pids, &capacity) == -1) {
+        return -1;
+      }
+      if (*end == '\0') {
+        return 0;
+      }
+      p = end + 1;
+    }
+  }
+
+  char procs_path[PATH_MAX];
+  snprintf(procs_path, sizeof(procs_path), "%s%s/cgroup.procs",
+           *arg == '/' ? "" : CGROUP_ROOT "/", arg);
+  FILE *procs = fopen(procs_path, "r");
+  if (!procs) {
+    perror("open cgroup.procs");
+    return -1;
+  }
+  int pid;
+  while (fscanf(procs, "%d", &pid) == 1) {
+    // the processes may exit while the cgroup is read
+    if (pid != getpid() && kill(pid, 0) == 0 &&
+        add_target(pid, pids, num_pids, &capacity) == -1) {
+      fclose(procs);
+      return -1;
+    }
+  }
+  fclose(procs);
+  if (*num_pids == 0) {
+    fprintf(stderr, "No process in %s\n", procs_path);
+    return -1;
+  }
+  return 0;
+}
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s <pid>[,<pid>...] | <cgroup> <ip:port | image file> [-p] "
+          "[-r <max rounds>] [-t <dirty pages threshold>] [-l] "
+          "[-j <streams>] [-z <compression level>] [-d <delta cache MiB>] "
+          "[-m <page buffers MiB>] [-w <workers>]\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  migrate_options_t options = {
+      .max_rounds = PRECOPY_MAX_ROUNDS,
+      .dirty_threshold = PRECOPY_DIRTY_THRESHOLD,
+      .num_streams = DEFAULT_STREAMS,
+      .cache_size = XBZRLE_CACHE_SIZE,
+  };
+  size_t memory_budget = STREAM_MEMORY_BUDGET;
+  int num_workers = DRAIN_WORKERS;
+  while (opt = getopt(argc, argv, "pr:t:lj:z:d:m:w:"), opt != -1) {
+    switch (opt) {
+    case 'p':
+      options.use_precopy = true;
+      break;
+    case 'r':
+      options.max_rounds = atoi(optarg);
+      break;
+    case 't':
+      options.dirty_threshold = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      options.use_postcopy = true;
+      break;
+    case 'j':
+      options.num_streams = atoi(optarg);
+      break;
+    case 'z':
+      options.compress_level = atoi(optarg);
+      break;
+    case 'd':
+      options.cache_size = strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'm':
+      memory_budget = strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'w':
+      num_workers = atoi(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (options.use_precopy && options.use_postcopy) {
+    fprintf(stderr, "Pre-copy and post-copy are exclusive\n");
+    return EXIT_FAILURE;
+  }
+  int num_streams = options.num_streams;
+  if (num_streams < 1 || num_streams > MAX_STREAMS) {
+    fprintf(stderr, "The number of streams must be between 1 and %d\n",
+            MAX_STREAMS);
+    return EXIT_FAILURE;
+  }
+  if (options.compress_level < 0 ||
+      options.compress_level > COMPRESS_LEVEL_MAX) {
+    fprintf(stderr, "The compression level must be between 0 and %d\n",
+            COMPRESS_LEVEL_MAX);
+    return EXIT_FAILURE;
+  }
+  size_t min_buffers = stream_min_buffers(num_streams, options.compress_level);
+  if (memory_budget < min_buffers * STREAM_CHUNK_SIZE) {
+    fprintf(stderr, "The page buffers need at least %zu MiB with %d streams\n",
+            (min_buffers * STREAM_CHUNK_SIZE) >> 20, num_streams);
+    return EXIT_FAILURE;
+  }
+  if (num_workers < 1 || num_workers > DRAIN_MAX_WORKERS) {
+    fprintf(stderr, "The number of workers must be between 1 and %d\n",
+            DRAIN_MAX_WORKERS);
+    return EXIT_FAILURE;
+  }
+
+  // Check if the target processes exist
+  pid_t *pids;
+  size_t num_pids;
+  int ret = -1;
+  if (read_targets(argv[optind], &pids, &num_pids) == -1) {
+    goto free;
+  }
+
+  // a destination without a port is an image file
+  char *send_socket = argv[optind + 1];
+  if (!strchr(send_socket, ':')) {
+    if (options.use_precopy || options.use_postcopy) {
+      fprintf(stderr, "Pre-copy and post-copy need a destination ip:port\n");
+      goto free;
+    }
+    if (num_pids > 1) {
+      fprintf(stderr, "An image holds a single process\n");
+      goto free;
+    }
+    ret = checkpoint_to_image(pids[0], send_socket);
+    goto free;
+  }
+
+  // parse ip and port to socket address
+  const char *ip = strtok(send_socket, ":");
+  const char *port = strtok(NULL, ":");
+  if (ip == NULL || port == NULL) {
+    fprintf(stderr, "Invalid ip:port\n");
+    goto free;
+  }
+  struct sockaddr_in *server_addr = &options.server_addr;
+  server_addr->sin_family = AF_INET;
+  server_addr->sin_port = htons(atoi(port));
+  server_addr->sin_addr.s_addr = inet_addr(ip);
+  if (inet_pton(AF_INET, ip, &server_addr->sin_addr) != 1) {
+    perror("inet_pton");
+    goto free;
+  }
+
+  if (options.use_precopy && !soft_dirty_supported()) {
+    fprintf(stderr, "Soft-dirty tracking unavailable, pre-copy disabled\n");
+    options.use_precopy = false;
+  }
+
+  // The page data held at any time is bounded by the pool of chunk buffers of
+  // each worker, reused by every round and every migration
+  if ((size_t)num_workers > num_pids) {
+    num_workers = num_pids;
+  }
+  ret = drain(pids, num_pids, num_workers, &options, memory_budget);
+  zero_scan_report();
+  compress_report();
+
+free:
+  free(pids);
+  return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+#include "compress.h"
+#include "ptrace.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_LOG 14
+#define MAX_PROBES 256
+
+// Matches at least this long end the search for a longer one
+#define NICE_MATCH 256
+
+// After an incompressible record, or while the link is faster than the
+// compressor, records are sent raw before compressing again. The number of
+// raw records doubles each time compression does not pay off.
+#define COMPRESS_BACKOFF 16
+#define COMPRESS_MAX_BACKOFF 1024
+
+// A record is sent compressed if it shrinks by at least 1/8
+#define MIN_SAVING(size) ((size) / 8)
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static size_t match_length(const uint8_t *a, const uint8_t *b,
+                           const uint8_t *end) {
+  const uint8_t *start = b;
+  while (b + sizeof(uint64_t) <= end) {
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    if (x != y) {
+      return b - start + (__builtin_ctzll(x ^ y) >> 3);
+    }
+    a += sizeof(uint64_t);
+    b += sizeof(uint64_t);
+  }
+  while (b < end && *a == *b) {
+    a++;
+    b++;
+  }
+  return b - start;
+}
+
+static uint8_t *write_length(uint8_t *out, size_t len) {
+  while (len >= 255) {
+    *out++ = 255;
+    len -= 255;
+  }
+  *out++ = len;
+  return out;
+}
+
+// Writes a sequence: literals followed by a match, or only literals for the
+// last sequence of a block (match_len 0)
+static uint8_t *write_sequence(uint8_t *out, const uint8_t *out_end,
+                               const uint8_t *literals, size_t literal_len,
+                               size_t offset, size_t match_len) {
+  size_t needed = 1 + literal_len / 255 + 1 + literal_len + 2 +
+                  match_len / 255 + 1;
+  if ((size_t)(out_end - out) < needed) {
+    return NULL;
+  }
+  size_t match_code = match_len ? match_len - MIN_MATCH : 0;
+  uint8_t *token = out++;
+  *token = (literal_len < 15 ? literal_len : 15) << 4;
+  if (literal_len >= 15) {
+    out = write_length(out, literal_len - 15);
+  }
+  memcpy(out, literals, literal_len);
+  out += literal_len;
+  if (match_len == 0) {
+    return out;
+  }
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  *token |= match_code < 15 ? match_code : 15;
+  if (match_code >= 15) {
+    out = write_length(out, match_code - 15);
+  }
+  return out;
+}
+
+size_t compress_block(const char *src, size_t len, char *dst, size_t cap,
+                      int level) {
+  // last position seen for each hash, and at higher levels the distance to
+  // the previous position with the same hash
+  uint32_t table[1 << HASH_LOG];
+  uint16_t chain[MAX_OFFSET + 1];
+  memset(table, 0, sizeof(table));
+  int max_probes = level <= COMPRESS_LEVEL_FAST ? 1 : 1 << (level - 1);
+  if (max_probes > MAX_PROBES) {
+    max_probes = MAX_PROBES;
+  }
+
+  const uint8_t *in = (const uint8_t *)src;
+  const uint8_t *in_end = in + len;
+  uint8_t *out = (uint8_t *)dst;
+  const uint8_t *out_end = out + cap;
+  size_t anchor = 0, pos = 0;
+  unsigned misses = 0;
+  while (pos + MIN_MATCH <= len) {
+    uint32_t h = hash4(read32(in + pos));
+    size_t candidate = table[h];
+    if (max_probes > 1) {
+      chain[pos & MAX_OFFSET] =
+          candidate < pos && pos - candidate <= MAX_OFFSET ? pos - candidate
+                                                           : 0;
+    }
+    table[h] = pos;
+
+    size_t best_len = 0, best_offset = 0;
+    for (int probe = 0; probe < max_probes; probe++) {
+      if (candidate >= pos || pos - candidate > MAX_OFFSET) {
+        break;
+      }
+      if (read32(in + candidate) == read32(in + pos)) {
+        size_t match_len =
+            MIN_MATCH + match_length(in + candidate + MIN_MATCH,
+                                     in + pos + MIN_MATCH, in_end);
+        if (match_len > best_len) {
+          best_len = match_len;
+          best_offset = pos - candidate;
+        }
+        if (best_len >= NICE_MATCH) {
+          break;
+        }
+      }
+      uint16_t delta = chain[candidate & MAX_OFFSET];
+      if (max_probes == 1 || delta == 0 || delta > candidate) {
+        break;
+      }
+      candidate -= delta;
+    }
+
+    if (best_len < MIN_MATCH) {
+      // skip faster through data that does not compress
+      misses++;
+      pos += 1 + (misses >> 6);
+      continue;
+    }
+    misses = 0;
+    out = write_sequence(out, out_end, in + anchor, pos - anchor, best_offset,
+                         best_len);
+    if (!out) {
+      return 0;
+    }
+    // at higher levels, also index the positions covered by the match
+    if (max_probes > 1) {
+      for (size_t p = pos + 1; p < pos + best_len && p + MIN_MATCH <= len;
+           p++) {
+        uint32_t hp = hash4(read32(in + p));
+        chain[p & MAX_OFFSET] = p - table[hp] <= MAX_OFFSET ? p - table[hp] : 0;
+        table[hp] = p;
+      }
+    }
+    pos += best_len;
+    anchor = pos;
+  }
+
+  out = write_sequence(out, out_end, in + anchor, len - anchor, 0, 0);
+  if (!out) {
+    return 0;
+  }
+  return out - (uint8_t *)dst;
+}
+
+static int read_length(const uint8_t **in, const uint8_t *in_end,
+                       size_t *len) {
+  uint8_t byte;
+  do {
+    if (*in >= in_end) {
+      return -1;
+    }
+    byte = *(*in)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int decompress_block(const char *src, size_t compressed_len, char *dst,
+                     size_t len) {
+  const uint8_t *in = (const uint8_t *)src;
+  const uint8_t *in_end = in + compressed_len;
+  uint8_t *out = (uint8_t *)dst;
+  uint8_t *out_end = out + len;
+  while (in < in_end) {
+    uint8_t token = *in++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && read_length(&in, in_end, &literal_len) == -1) {
+      return -1;
+    }
+    if (literal_len > (size_t)(in_end - in) ||
+        literal_len > (size_t)(out_end - out)) {
+      return -1;
+    }
+    memcpy(out, in, literal_len);
+    in += literal_len;
+    out += literal_len;
+    if (in == in_end) {
+      break; // the last sequence only has literals
+    }
+
+    if (in_end - in < 2) {
+      return -1;
+    }
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && read_length(&in, in_end, &match_len) == -1) {
+      return -1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(out - (uint8_t *)dst) ||
+        match_len > (size_t)(out_end - out)) {
+      return -1;
+    }
+    const uint8_t *match = out - offset;
+    if (offset >= match_len) {
+      memcpy(out, match, match_len);
+      out += match_len;
+    } else {
+      // overlapping copy repeats the last offset bytes
+      for (size_t i = 0; i < match_len; i++) {
+        *out++ = match[i];
+      }
+    }
+  }
+  return out == out_end ? 0 : -1;
+}
+
+static size_t total_attempted_bytes = 0;
+static size_t total_raw_bytes = 0;
+static size_t total_compressed_bytes = 0;
+static size_t total_compressed_records = 0;
+static size_t total_records = 0;
+static long long total_compress_ns = 0;
+
+int compressor_init(compressor_t *compressor, int level, size_t max_size) {
+  memset(compressor, 0, sizeof(*compressor));
+  compressor->level = level;
+  compressor->backoff = COMPRESS_BACKOFF;
+  if (level == 0) {
+    return 0;
+  }
+  compressor->buf_size = COMPRESS_BOUND(max_size);
+  compressor->buf = malloc(compressor->buf_size);
+  if (!compressor->buf) {
+    perror("malloc compression buffer");
+    return -1;
+  }
+  return 0;
+}
+
+void compressor_free(compressor_t *compressor) {
+  free(compressor->buf);
+  compressor->buf = NULL;
+}
+
+static void back_off(compressor_t *compressor) {
+  compressor->skip = compressor->backoff;
+  if (compressor->backoff < COMPRESS_MAX_BACKOFF) {
+    compressor->backoff *= 2;
+  }
+}
+
+size_t compressor_try(compressor_t *compressor, const char *content,
+                      size_t size) {
+  if (compressor->level == 0 || size > compressor->buf_size) {
+    return 0;
+  }
+  __atomic_fetch_add(&total_records, 1, __ATOMIC_RELAXED);
+  if (compressor->skip > 0) {
+    compressor->skip--;
+    return 0;
+  }
+
+  uint64_t start = get_time_ns();
+  size_t compressed = compress_block(content, size, compressor->buf,
+                                     compressor->buf_size, compressor->level);
+  long long ns = get_time_ns() - start;
+  __atomic_fetch_add(&total_compress_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&total_attempted_bytes, size, __ATOMIC_RELAXED);
+  double ns_per_byte = (double)ns / size;
+  compressor->compress_ns_per_byte =
+      compressor->compress_ns_per_byte > 0
+          ? 0.75 * compressor->compress_ns_per_byte + 0.25 * ns_per_byte
+          : ns_per_byte;
+
+  if (compressed == 0 || compressed > size - MIN_SAVING(size)) {
+    back_off(compressor);
+    return 0;
+  }
+  // the link is faster than the compressor: keep this record, but send the
+  // next ones raw
+  double saved_ns = (size - compressed) * compressor->link_ns_per_byte;
+  if (compressor->link_ns_per_byte > 0 &&
+      size * compressor->compress_ns_per_byte > saved_ns) {
+    back_off(compressor);
+  } else {
+    compressor->backoff = COMPRESS_BACKOFF;
+  }
+  __atomic_fetch_add(&total_raw_bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&total_compressed_bytes, compressed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&total_compressed_records, 1, __ATOMIC_RELAXED);
+  return compressed;
+}
+
+void compressor_account_link(compressor_t *compressor, size_t bytes,
+                             long long ns) {
+  // the socket buffer absorbs single records, only the average over all of
+  // them tells the link speed
+  compressor->link_bytes += bytes;
+  compressor->link_ns += ns;
+  compressor->link_ns_per_byte =
+      (double)compressor->link_ns / compressor->link_bytes;
+}
+
+void compress_report(void) {
+  if (total_records == 0) {
+    return;
+  }
+  double seconds = (double)total_compress_ns / 1e9;
+  printf("Compression: %zu of %zu records, %zu bytes in %zu bytes (%.2fx), "
+         "%.2f GB/s\n",
+         total_compressed_records, total_records, total_raw_bytes,
+         total_compressed_bytes,
+         total_compressed_bytes > 0
+             ? (double)total_raw_bytes / total_compressed_bytes
+             : 0.0,
+         seconds > 0 ? total_attempted_bytes / 1e9 / seconds : 0.0);
+}
@@ -0,0 +1,422 @@
+#include "image.h"
+#include "capture.h"
+#include "wire.h"
+#include "zeropage.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1))
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, offset);
+    if (ret == -1) {
+      perror("pwrite image");
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+    offset += ret;
+  }
+  return 0;
+}
+
+// Write the non-zero pages of buf at offset, the zero pages stay holes
+static int write_pages(int fd, const char *buf, size_t len, off_t offset) {
+  size_t num_pages = len / PAGE_SIZE;
+  size_t zero_pages = 0;
+  uint64_t scan_start = get_time_ns();
+  size_t i = 0;
+  while (i < num_pages) {
+    if (is_zero_page(buf + i * PAGE_SIZE)) {
+      zero_pages++;
+      i++;
+      continue;
+    }
+    size_t run = 1;
+    while (i + run < num_pages && !is_zero_page(buf + (i + run) * PAGE_SIZE)) {
+      run++;
+    }
+    if (pwrite_all(fd, buf + i * PAGE_SIZE, run * PAGE_SIZE,
+                   offset + i * PAGE_SIZE) == -1) {
+      return -1;
+    }
+    i += run;
+  }
+  zero_scan_account(num_pages, zero_pages, get_time_ns() - scan_start);
+  return 0;
+}
+
+// Split the page runs at the region boundaries into the extents of each
+// region, and lay out the contents of the regions one after the other from
+// offset 0. Returns the number of extents.
+static size_t build_extents(const memory_dump_t *layout,
+                            const page_runs_t *runs, image_region_t *records,
+                            image_extent_t *extents, size_t *data_size) {
+  size_t r = 0;
+  size_t num_extents = 0;
+  size_t offset = 0;
+  for (size_t i = 0; i < layout->num_regions; i++) {
+    const memory_region_t *region = &layout->regions[i];
+    records[i].first_extent = num_extents;
+    records[i].data_offset = offset;
+    while (r < runs->num_runs && runs->runs[r].start < region->end) {
+      const page_run_t *run = &runs->runs[r];
+      if (run->end > region->start) {
+        unsigned long lo =
+            run->start > region->start ? run->start : region->start;
+        unsigned long hi = run->end < region->end ? run->end : region->end;
+        extents[num_extents].offset = lo - region->start;
+        extents[num_extents].size = hi - lo;
+        num_extents++;
+        offset += hi - lo;
+      }
+      // a run over adjacent regions goes on in the next one
+      if (run->end > region->end) {
+        break;
+      }
+      r++;
+    }
+    records[i].num_extents = num_extents - records[i].first_extent;
+  }
+  *data_size = offset;
+  return num_extents;
+}
+
+bool is_image_file(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  uint32_t magic;
+  bool is_image = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+                  le32toh(magic) == IMAGE_MAGIC;
+  close(fd);
+  return is_image;
+}
+
+int write_image(const char *path, pid_t pid, const process_dump_t *dump,
+                const page_runs_t *runs) {
+  const memory_dump_t *layout = &dump->memory_dump;
+  size_t num_regions = layout->num_regions;
+  image_region_t *records = calloc(num_regions, sizeof(*records));
+  image_extent_t *extents =
+      calloc(runs->num_runs + num_regions, sizeof(*extents));
+  string_table_t strtab = {0};
+  char *index = NULL;
+  char *buf = malloc(IMAGE_CHUNK_SIZE);
+  int fd = -1;
+  int ret = -1;
+  uint64_t start_time = get_time_ns();
+  if ((num_regions > 0 && !records) || !extents || !buf) {
+    perror("malloc image index");
+    goto free;
+  }
+
+  size_t data_size;
+  size_t num_extents =
+      build_extents(layout, runs, records, extents, &data_size);
+  for (size_t i = 0; i < num_regions; i++) {
+    long path_offset = add_string(&strtab, layout->regions[i].path);
+    if (path_offset == -1) {
+      goto free;
+    }
+    records[i].path = path_offset;
+  }
+
+  // the index, padded to the first page of contents
+  size_t xstate_size = dump->cpu_states[0].xstate_size;
+  size_t state_size = offsetof(cpu_state_t, xstate) + xstate_size;
+  size_t index_size = sizeof(image_header_t) + dump->num_threads * state_size +
+                      num_regions * sizeof(*records) +
+                      num_extents * sizeof(*extents) + strtab.size;
+  size_t data_offset = PAGE_ALIGN(index_size);
+  index = calloc(1, data_offset);
+  if (!index) {
+    perror("malloc image index");
+    goto free;
+  }
+  char *p = index + sizeof(image_header_t);
+  for (size_t i = 0; i < dump->num_threads; i++) {
+    memcpy(p, &dump->cpu_states[i], state_size);
+    p += state_size;
+  }
+  for (size_t i = 0; i < num_regions; i++) {
+    const memory_region_t *region = &layout->regions[i];
+    image_region_t record = {
+        .start = htole64(region->start),
+        .end = htole64(region->end),
+        .offset = htole64(region->offset),
+        .path = htole32(records[i].path),
+        .data_offset = htole64(data_offset + records[i].data_offset),
+        .first_extent = htole32(records[i].first_extent),
+        .num_extents = htole32(records[i].num_extents),
+        .flags = htole32(region->huge_pages ? WIRE_REGION_HUGE_PAGES : 0),
+    };
+    memcpy(record.permissions, region->permissions,
+           sizeof(record.permissions));
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+  }
+  for (size_t i = 0; i < num_extents; i++) {
+    image_extent_t extent = {
+        .offset = htole64(extents[i].offset),
+        .size = htole64(extents[i].size),
+    };
+    memcpy(p, &extent, sizeof(extent));
+    p += sizeof(extent);
+  }
+  memcpy(p, strtab.strings, strtab.size);
+
+  image_header_t header = {
+      .magic = htole32(IMAGE_MAGIC),
+      .version = htole16(IMAGE_VERSION),
+      .regs_size = htole16(offsetof(cpu_state_t, xstate)),
+      .num_threads = htole32(dump->num_threads),
+      .xstate_size = htole32(xstate_size),
+      .num_regions = htole32(num_regions),
+      .num_extents = htole32(num_extents),
+      .strtab_size = htole32(strtab.size),
+      .index_checksum = htole32(wire_checksum(0, index + sizeof(header),
+                                              index_size - sizeof(header))),
+      .data_offset = htole64(data_offset),
+      .file_size = htole64(data_offset + data_size),
+  };
+  header.checksum =
+      htole32(wire_checksum(0, &header, offsetof(image_header_t, checksum)));
+  memcpy(index, &header, sizeof(header));
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("open image");
+    goto free;
+  }
+  if (pwrite_all(fd, index, data_offset, 0) == -1) {
+    goto free;
+  }
+
+  // the contents, read from the process a chunk at a time
+  capture_t capture;
+  if (capture_open(&capture, pid) == -1) {
+    goto free;
+  }
+  for (size_t i = 0; i < num_regions; i++) {
+    const memory_region_t *region = &layout->regions[i];
+    off_t offset = data_offset + records[i].data_offset;
+    for (size_t e = 0; e < records[i].num_extents; e++) {
+      const image_extent_t *extent = &extents[records[i].first_extent + e];
+      for (size_t done = 0; done < extent->size; done += IMAGE_CHUNK_SIZE) {
+        size_t len = extent->size - done < IMAGE_CHUNK_SIZE
+                         ? extent->size - done
+                         : IMAGE_CHUNK_SIZE;
+        if (capture_read_range(&capture, buf,
+                               region->start + extent->offset + done,
+                               len) == -1 ||
+            write_pages(fd, buf, len, offset) == -1) {
+          capture_close(&capture);
+          goto free;
+        }
+        offset += len;
+      }
+    }
+  }
+  capture_close(&capture);
+
+  // trailing zero pages are holes too
+  if (ftruncate(fd, data_offset + data_size) == -1) {
+    perror("ftruncate image");
+    goto free;
+  }
+  if (fsync(fd) == -1) {
+    perror("fsync image");
+    goto free;
+  }
+  printf("Image written: %zu threads, %zu regions, %zu extents, %zu bytes of "
+         "pages after a %zu bytes index in %.1f ms\n",
+         dump->num_threads, num_regions, num_extents, data_size, data_offset,
+         (get_time_ns() - start_time) / 1e6);
+  ret = 0;
+
+free:
+  if (fd != -1) {
+    close(fd);
+  }
+  free(buf);
+  free(index);
+  free_strings(&strtab);
+  free(extents);
+  free(records);
+  return ret;
+}
+
+int load_image(const char *path, process_dump_t *dump) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("open image");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror("fstat image");
+    close(fd);
+    return -1;
+  }
+  size_t file_size = st.st_size;
+  if (file_size < sizeof(image_header_t)) {
+    fprintf(stderr, "Not a checkpoint image\n");
+    close(fd);
+    return -1;
+  }
+  // The mapping is private and never unmapped: the regions point into it
+  // until the process is restored, and its pages are only read in from the
+  // file when they are touched.
+  char *image = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    perror("mmap image");
+    return -1;
+  }
+
+  image_header_t header;
+  memcpy(&header, image, sizeof(header));
+  if (le32toh(header.magic) != IMAGE_MAGIC ||
+      le32toh(header.checksum) !=
+          wire_checksum(0, &header, offsetof(image_header_t, checksum))) {
+    fprintf(stderr, "Not a checkpoint image\n");
+    goto fail;
+  }
+  size_t num_threads = le32toh(header.num_threads);
+  size_t xstate_size = le32toh(header.xstate_size);
+  size_t num_regions = le32toh(header.num_regions);
+  size_t num_extents = le32toh(header.num_extents);
+  size_t strtab_size = le32toh(header.strtab_size);
+  size_t data_offset = le64toh(header.data_offset);
+  if (le16toh(header.version) != IMAGE_VERSION ||
+      le16toh(header.regs_size) != offsetof(cpu_state_t, xstate) ||
+      num_threads < 1 || num_threads > MAX_THREADS ||
+      xstate_size > XSTATE_MAX_SIZE) {
+    fprintf(stderr, "Unsupported image version %u\n",
+            le16toh(header.version));
+    goto fail;
+  }
+  size_t state_size = offsetof(cpu_state_t, xstate) + xstate_size;
+  size_t index_size = sizeof(header) + num_threads * state_size +
+                      num_regions * sizeof(image_region_t) +
+                      num_extents * sizeof(image_extent_t) + strtab_size;
+  if (le64toh(header.file_size) != file_size || index_size > data_offset ||
+      data_offset % PAGE_SIZE != 0 || data_offset > file_size ||
+      wire_checksum(0, image + sizeof(header), index_size - sizeof(header)) !=
+          le32toh(header.index_checksum)) {
+    fprintf(stderr, "Corrupted image index\n");
+    goto fail;
+  }
+
+  const char *p = image + sizeof(header);
+  dump->cpu_states = malloc(num_threads * sizeof(cpu_state_t));
+  dump->memory_dump.regions = calloc(num_regions, sizeof(memory_region_t));
+  if (!dump->cpu_states || (num_regions > 0 && !dump->memory_dump.regions)) {
+    perror("malloc image");
+    goto fail;
+  }
+  dump->num_threads = num_threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    memcpy(&dump->cpu_states[i], p, state_size);
+    dump->cpu_states[i].xstate_size = xstate_size;
+    p += state_size;
+  }
+  const char *records = p;
+  const char *extents = records + num_regions * sizeof(image_region_t);
+  const char *strtab = extents + num_extents * sizeof(image_extent_t);
+
+  size_t content_bytes = 0;
+  for (size_t i = 0; i < num_regions; i++) {
+    memory_region_t *region = &dump->memory_dump.regions[i];
+    image_region_t record;
+    memcpy(&record, records + i * sizeof(record), sizeof(record));
+    dump->memory_dump.num_regions = i + 1;
+
+    size_t path = le32toh(record.path);
+    size_t path_len = path < strtab_size
+                          ? strnlen(strtab + path, strtab_size - path)
+                          : strtab_size;
+    if (path >= strtab_size || path + path_len >= strtab_size ||
+        path_len >= sizeof(region->path)) {
+      fprintf(stderr, "Invalid path of region %zu\n", i);
+      goto fail;
+    }
+    region->start = le64toh(record.start);
+    region->end = le64toh(record.end);
+    region->size = region->end - region->start;
+    region->offset = le64toh(record.offset);
+    memcpy(region->permissions, record.permissions,
+           sizeof(record.permissions));
+    region->permissions[sizeof(record.permissions)] = '\0';
+    memcpy(region->path, strtab + path, path_len + 1);
+    region->huge_pages =
+        (le32toh(record.flags) & WIRE_REGION_HUGE_PAGES) != 0;
+
+    size_t first_extent = le32toh(record.first_extent);
+    size_t region_extents = le32toh(record.num_extents);
+    size_t region_offset = le64toh(record.data_offset);
+    if (region->end < region->start || first_extent > num_extents ||
+        region_extents > num_extents - first_extent ||
+        region_offset % PAGE_SIZE != 0) {
+      fprintf(stderr, "Invalid extents of region %zu\n", i);
+      goto fail;
+    }
+    if (region_extents == 0) {
+      continue;
+    }
+    region->extents = malloc(region_extents * sizeof(page_extent_t));
+    if (!region->extents) {
+      perror("malloc extents");
+      goto fail;
+    }
+    size_t size = 0;
+    for (size_t e = 0; e < region_extents; e++) {
+      image_extent_t extent;
+      memcpy(&extent, extents + (first_extent + e) * sizeof(extent),
+             sizeof(extent));
+      region->extents[e].offset = le64toh(extent.offset);
+      region->extents[e].size = le64toh(extent.size);
+      if (region->extents[e].offset > region->size ||
+          region->extents[e].size > region->size - region->extents[e].offset) {
+        fprintf(stderr, "Invalid extents of region %zu\n", i);
+        goto fail;
+      }
+      size += region->extents[e].size;
+    }
+    region->num_extents = region_extents;
+    if (region_offset < data_offset || region_offset > file_size ||
+        size > file_size - region_offset) {
+      fprintf(stderr, "Invalid extents of region %zu\n", i);
+      goto fail;
+    }
+    region->content = image + region_offset;
+    region->image_offset = region_offset;
+    content_bytes += size;
+  }
+  dump->memory_dump.image_path = path;
+  printf("Image loaded: %zu threads, %zu regions, %zu bytes of pages mapped "
+         "from %s\n",
+         num_threads, num_regions, content_bytes, path);
+  return 0;
+
+fail:
+  // the contents belong to the mapping
+  for (size_t i = 0; i < dump->memory_dump.num_regions; i++) {
+    free(dump->memory_dump.regions[i].extents);
+  }
+  free(dump->memory_dump.regions);
+  free(dump->cpu_states);
+  memset(dump, 0, sizeof(*dump));
+  munmap(image, file_size);
+  return -1;
+}
@@ -12,34 +12,43 @@ static struct file_operations fops = {
     .open = device_open,
     .read = device_read,
     .write = device_write,
+    .unlocked_ioctl = device_ioctl,
     .release = device_release,
 };
 
 enum dev_state {
-  ENTRY,     // initial state, device is free
-  REMAPPING, // waiting for following writes to get memory mapping and contents
+  REMAPPING, // waiting for the restore to begin
+  MAPPING,   // memory unmapped, waiting for the regions and their contents
+  COMMITTED, // restore done, waiting for the device to be closed
 };
 
-static struct krestore_args_t {
+// State of one restore, kept with each open file of the device so that
+// processes can be restored in parallel
+struct krestore_session {
   enum dev_state state;
   pid_t pid; // which process we are restoring memory on
-} krestore_config;
+  unsigned long scratch; // its scratch area, kept until the restore is done
+  struct cached_file files[FILE_CACHE_SIZE];
+  size_t next_file; // slot of the next file opened, replaced in turn
+};
 
 // Implement your file operations here
 static int device_open(struct inode *inodep, struct file *filep) {
-  printk(KERN_INFO "/dev/krestore: Device has been opened\n");
-  if (krestore_config.state != ENTRY) {
-    return -EBUSY;
+  struct krestore_session *session = kzalloc(sizeof(*session), GFP_KERNEL);
+  if (session == NULL) {
+    return -ENOMEM;
   }
-  krestore_config.state = REMAPPING;
-  printk(KERN_INFO "/dev/krestore: Device is ready -> REMAPPING\n");
+  session->state = REMAPPING;
+  filep->private_data = session;
+  printk(KERN_INFO "/dev/krestore: Device has been opened -> REMAPPING\n");
   return 0;
 }
 
 static int device_release(struct inode *inodep, struct file *filep) {
-  krestore_config.state = ENTRY;
-  krestore_config.pid = 0;
-  printk(KERN_INFO "/dev/krestore: Device has been closed -> ENTRY\n");
+  struct krestore_session *session = filep->private_data;
+  close_files(session); // if the restore failed before its commit
+  kfree(session);
+  printk(KERN_INFO "/dev/krestore: Device has been closed\n");
   return 0;
 }
 
@@ -51,39 +60,28 @@ static ssize_t device_read(struct file *filep, char *buffer, size_t len,
 
 static ssize_t device_write(struct file *filep, const char *buffer, size_t len,
                             loff_t *offset) {
-  switch (krestore_config.state) {
-
-  case REMAPPING:
-    process_dump_t dump;
-    int ret_parse = parse_dump_from_user(&dump, buffer, len);
-    if (ret_parse != 0) {
-      printk(KERN_ALERT "/dev/krestore: Failed to parse the dump from user\n");
-      return ret_parse;
-    }
-
-    int ret = 0;
-    ret = unmap_all();
-    if (ret != 0) {
-      printk(KERN_ALERT "/dev/krestore: Failed to unmap all regions\n");
-      goto free_return;
-    }
-
-    ret = map_all(dump.regions, dump.num_regions);
-    if (ret != 0) {
-      printk(KERN_ALERT "/dev/krestore: Failed to map all regions\n");
-      goto free_return;
-    }
-
-  free_return:
-    free_process_dump(&dump);
-    return ret;
+  // write is not supported, the restore is made of ioctls
+  return -EINVAL;
+}
 
+static long device_ioctl(struct file *filep, unsigned int cmd,
+                         unsigned long arg) {
+  struct krestore_session *session = filep->private_data;
+  switch (cmd) {
+  case KRESTORE_BEGIN:
+    return restore_begin(session, arg);
+  case KRESTORE_MAP:
+    return restore_map(session, (const krestore_map_t __user *)arg);
+  case KRESTORE_FILL:
+    return restore_fill(session, (const krestore_fill_t __user *)arg);
+  case KRESTORE_COMMIT:
+    return restore_commit(session);
   default:
-    return -EINVAL;
+    return -ENOTTY;
   }
 }
 
-static int unmap_all(void) {
+static int unmap_all(unsigned long keep) {
   struct mm_struct *mm = current->mm;
   struct vm_area_struct *vma = mm->mmap;
   int ret = 0;
@@ -96,6 +94,12 @@ static int unmap_all(void) {
       continue;
     }
 
+    // the restorer runs the next steps from the scratch area
+    if (vma->vm_start <= keep && keep < vma->vm_end) {
+      vma = next_vma;
+      continue;
+    }
+
     // only keep a special rw anonymous mapping (essential for continued
     // execution after return to user space and restore the registers)
     if (vma->vm_flags & VM_READ && vma->vm_flags & VM_WRITE &&
@@ -118,188 +122,255 @@ static int unmap_all(void) {
   return ret;
 }
 
-static unsigned long parse_permissions(const char *permissions) {
-  unsigned long ret = 0;
-  if (permissions[0] == 'r') {
-    ret |= PROT_READ;
+static void advise_huge_pages(unsigned long start) {
+  struct mm_struct *mm = current->mm;
+  mmap_write_lock(mm);
+  struct vm_area_struct *vma = find_vma(mm, start);
+  if (vma != NULL && vma->vm_start <= start) {
+    vma->vm_flags &= ~VM_NOHUGEPAGE;
+    vma->vm_flags |= VM_HUGEPAGE;
   }
-  if (permissions[1] == 'w') {
-    ret |= PROT_WRITE;
+  mmap_write_unlock(mm);
+}
+
+static bool is_restoring(const struct krestore_session *session) {
+  return session->state == MAPPING && session->pid == current->tgid;
+}
+
+static long restore_begin(struct krestore_session *session,
+                          unsigned long scratch) {
+  if (session->state != REMAPPING || (scratch & ~PAGE_MASK) != 0) {
+    return -EINVAL;
   }
-  if (permissions[2] == 'x') {
-    ret |= PROT_EXEC;
+  int ret = unmap_all(scratch);
+  if (ret != 0) {
+    printk(KERN_ALERT "/dev/krestore: Failed to unmap all regions\n");
+    return ret;
   }
-  return ret;
+  session->pid = current->tgid;
+  session->scratch = scratch;
+  session->state = MAPPING;
+  printk(KERN_INFO "/dev/krestore: Memory unmapped -> MAPPING\n");
+  return 0;
 }
 
-static int map_all(const memory_region_t *regions, size_t num) {
-  size_t ptr = 0; // pointer to the current region
-  int ret = 0;
-  for (; ptr < num; ptr++) {
-    memory_region_t *region = &regions[ptr];
-    unsigned long start = region->start;
-    unsigned long size = region->size;
-    unsigned long offset = region->offset;
-    unsigned long permissions = parse_permissions(region->permissions);
-    const char *path = region->path;
-    // skip kernel-related regions
-    if (strcmp(path, "[vdso]") == 0 || strcmp(path, "[vsyscall]") == 0 ||
-        strcmp(path, "[vvar]") == 0) {
-      continue;
+static struct file *get_file(struct krestore_session *session,
+                             const char *path) {
+  for (size_t i = 0; i < FILE_CACHE_SIZE; i++) {
+    struct cached_file *cached = &session->files[i];
+    if (cached->path != NULL && strcmp(cached->path, path) == 0) {
+      return cached->file;
     }
+  }
+
+  struct file *file = filp_open(path, O_RDONLY, 0);
+  if (IS_ERR(file)) {
+    printk(KERN_ALERT "/dev/krestore: Failed to open file %s\n", path);
+    return file;
+  }
+  char *cached_path = kstrdup(path, GFP_KERNEL);
+  if (cached_path == NULL) {
+    filp_close(file, NULL);
+    return ERR_PTR(-ENOMEM);
+  }
+  size_t slot = session->next_file;
+  struct cached_file *cached = &session->files[slot];
+  if (cached->path != NULL) {
+    filp_close(cached->file, NULL);
+    kfree(cached->path);
+  }
+  cached->path = cached_path;
+  cached->file = file;
+  session->next_file = (slot + 1) % FILE_CACHE_SIZE;
+  return file;
+}
 
-    const char *content = region->content;
-    unsigned long flags = MAP_PRIVATE | MAP_FIXED;
-    if (strcmp(path, "[stack]") == 0) {
-      flags |= MAP_GROWSDOWN;
+static void close_files(struct krestore_session *session) {
+  for (size_t i = 0; i < FILE_CACHE_SIZE; i++) {
+    struct cached_file *cached = &session->files[i];
+    if (cached->path != NULL) {
+      filp_close(cached->file, NULL);
+      kfree(cached->path);
+      cached->path = NULL;
+      cached->file = NULL;
     }
+  }
+  session->next_file = 0;
+}
 
-    // file-backed regions
-    if (strlen(path) > 0 && strstr(path, "/")) {
-      struct file *file = filp_open(path, O_RDONLY, 0);
-      if (IS_ERR(file)) {
-        printk(KERN_ALERT "/dev/krestore: Failed to open file %s\n", path);
-        goto fail;
+static long map_region(struct file *file, unsigned long start,
+                       unsigned long size, unsigned long offset, uint32_t prot,
+                       uint32_t flags) {
+  unsigned long mmap_flags = MAP_PRIVATE | MAP_FIXED;
+  if (file == NULL) {
+    mmap_flags |= MAP_ANONYMOUS;
+  }
+  if (flags & KRESTORE_REGION_STACK) {
+    mmap_flags |= MAP_GROWSDOWN;
+  }
+  unsigned long ret = vm_mmap(file, start, size, prot, mmap_flags, offset);
+  if (IS_ERR_VALUE(ret)) {
+    printk(KERN_ALERT "/dev/krestore: Failed to mmap region %lx-%lx\n", start,
+           start + size);
+    return (long)ret;
+  }
+  // the contents filled in afterwards then fault in huge pages
+  if (flags & KRESTORE_REGION_HUGE_PAGES) {
+    advise_huge_pages(start);
+  }
+  return 0;
+}
+
+static long restore_map(struct krestore_session *session,
+                        const krestore_map_t __user *user_map) {
+  if (!is_restoring(session)) {
+    return -EINVAL;
+  }
+  krestore_map_t map;
+  if (copy_from_user(&map, user_map, sizeof(map)) != 0) {
+    return -EFAULT;
+  }
+  const krestore_region_t __user *user_regions =
+      (const krestore_region_t __user *)(unsigned long)map.regions;
+  unsigned long scratch = session->scratch;
+
+  // only one record and one path are held at a time
+  char *path = kmalloc(PATH_MAX, GFP_KERNEL);
+  if (path == NULL) {
+    return -ENOMEM;
+  }
+  // run of adjacent anonymous regions not mapped yet
+  unsigned long anon_start = 0, anon_end = 0;
+  uint32_t anon_prot = 0, anon_flags = 0;
+  long ret = 0;
+  for (uint64_t i = 0; i < map.num_regions; i++) {
+    krestore_region_t region;
+    if (copy_from_user(&region, &user_regions[i], sizeof(region)) != 0) {
+      ret = -EFAULT;
+      break;
+    }
+    unsigned long start = region.start;
+    unsigned long size = region.size;
+    if ((start & ~PAGE_MASK) != 0 || size == 0 ||
+        (size & ~PAGE_MASK) != 0) {
+      ret = -EINVAL;
+      break;
+    }
+    // the scratch area is still in use, the restorer puts it in a hole
+    if (start < scratch + KRESTORE_SCRATCH_SIZE && scratch < start + size) {
+      ret = -EBUSY;
+      break;
+    }
+
+    // anonymous regions, mapped with the next ones if they can be merged
+    if (region.path == 0 && !(region.flags & KRESTORE_REGION_STACK)) {
+      if (anon_end == start && anon_prot == region.prot &&
+          anon_flags == region.flags) {
+        anon_end += size;
+        continue;
       }
-      ret = vm_mmap(file, start, size, permissions, flags, offset);
-      filp_close(file, NULL);
-      if (IS_ERR_VALUE(ret)) {
-        printk(KERN_ALERT "/dev/krestore: Failed to mmap region %lx-%lx, %s\n",
-               start, start + size, path);
-        goto fail;
+      if (anon_end != 0) {
+        ret = map_region(NULL, anon_start, anon_end - anon_start, 0,
+                         anon_prot, anon_flags);
+        if (ret != 0) {
+          break;
+        }
       }
+      anon_start = start;
+      anon_end = start + size;
+      anon_prot = region.prot;
+      anon_flags = region.flags;
       continue;
     }
 
-    flags |= MAP_ANONYMOUS; // anonymous regions
-    // mmap with write permission first
-    ret = vm_mmap(NULL, start, size, permissions | PROT_WRITE, flags, 0);
-    if (IS_ERR_VALUE(ret)) {
-      printk(KERN_ALERT "/dev/krestore: Failed to mmap region %lx-%lx, %s\n",
-             start, start + size, path);
-      goto fail;
-    }
-
-    if (content != NULL) {
-      ret = copy_to_user((void *)start, content, size);
+    // the regions mapped over an anonymous run come after it
+    if (anon_end != 0) {
+      ret = map_region(NULL, anon_start, anon_end - anon_start, 0, anon_prot,
+                       anon_flags);
+      anon_end = 0;
       if (ret != 0) {
-        printk(KERN_ALERT
-               "/dev/krestore: Failed to copy content to region %lx-%lx, %s\n",
-               start, start + size, path);
-        goto fail;
+        break;
       }
     }
-
-    // remap with the correct permission if the region is read-only at first
-    if ((permissions & PROT_WRITE) == 0) {
-      ret = vm_munmap(start, size);
-      if (ret != 0) {
-        printk(KERN_ALERT
-               "/dev/krestore: Failed to munmap region %lx-%lx, %s\n",
-               start, start + size, path);
-        goto fail;
+    struct file *file = NULL;
+    if (region.path != 0) {
+      long path_len = strncpy_from_user(
+          path, (const char __user *)(unsigned long)region.path, PATH_MAX);
+      if (path_len < 0 || path_len == PATH_MAX) {
+        ret = -EFAULT;
+        break;
       }
-      ret = vm_mmap(NULL, start, size, permissions, flags, 0);
-      if (IS_ERR_VALUE(ret)) {
-        printk(KERN_ALERT "/dev/krestore: Failed to mmap region %lx-%lx, %s\n",
-               start, start + size, path);
-        goto fail;
+      file = get_file(session, path);
+      if (IS_ERR(file)) {
+        ret = PTR_ERR(file);
+        break;
       }
     }
+    ret = map_region(file, start, size, region.offset, region.prot,
+                     region.flags);
+    if (ret != 0) {
+      break;
+    }
   }
-
-  return 0;
-
-fail:
-  return -1;
+  if (ret == 0 && anon_end != 0) {
+    ret = map_region(NULL, anon_start, anon_end - anon_start, 0, anon_prot,
+                     anon_flags);
+  }
+  kfree(path);
+  return ret;
 }
 
-static int parse_dump_from_user(process_dump_t *dump, const char *buffer,
-                                size_t len) {
-  if (len != sizeof(process_dump_t)) {
-    printk(KERN_ALERT "/dev/krestore: Invalid dump size\n");
+static long restore_fill(struct krestore_session *session,
+                         const krestore_fill_t __user *user_fill) {
+  if (!is_restoring(session)) {
     return -EINVAL;
   }
-
-  // shallow copy of the dump struct: num_regions
-  process_dump_t dump_tmp;
-  if (copy_from_user(&dump_tmp, buffer, len) != 0) {
-    printk(KERN_ALERT "/dev/krestore: Failed to copy dump from user\n");
+  krestore_fill_t fill;
+  if (copy_from_user(&fill, user_fill, sizeof(fill)) != 0) {
     return -EFAULT;
   }
 
-  // copy of the regions: start, end, permissions, path, size
-  memory_region_t *user_regions = dump_tmp.regions;
-  dump_tmp.regions =
-      kmalloc(dump_tmp.num_regions * sizeof(memory_region_t), GFP_KERNEL);
-  if (copy_from_user(dump_tmp.regions, user_regions,
-                     dump_tmp.num_regions * sizeof(memory_region_t)) != 0) {
-    kfree(dump_tmp.regions);
-    printk(KERN_ALERT "/dev/krestore: Failed to copy regions from user\n");
-    return -EFAULT;
+  // the contents go through one buffer, whatever their size
+  char *buffer = kmalloc(FILL_BUFFER_SIZE, GFP_KERNEL);
+  if (buffer == NULL) {
+    return -ENOMEM;
   }
-
-  // check the region.path exists
-  size_t i = 0;
-  for (; i < dump_tmp.num_regions; i++) {
-    if (strlen(dump_tmp.regions[i].path) > 0 &&
-        strstr(dump_tmp.regions[i].path, "/")) {
-      struct file *file = filp_open(dump_tmp.regions[i].path, O_RDONLY, 0);
-      if (IS_ERR(file)) {
-        kfree(dump_tmp.regions);
-        printk(KERN_ALERT "/dev/krestore: Failed to open file %s\n",
-               dump_tmp.regions[i].path);
-        return -ENOENT;
-      }
-      filp_close(file, NULL);
+  long ret = 0;
+  size_t done = 0;
+  while (done < fill.size) {
+    // a fill may span gigabytes: give up the CPU between chunks, and stop
+    // if the restored process is being killed
+    if (fatal_signal_pending(current)) {
+      ret = -EINTR;
+      break;
     }
-  }
-
-  // deep copy: copy the contents of each region if not null
-  i = 0;
-  for (; i < dump_tmp.num_regions; i++) {
-    if (dump_tmp.regions[i].content != NULL) {
-      char *user_content = dump_tmp.regions[i].content;
-      dump_tmp.regions[i].content =
-          kmalloc(dump_tmp.regions[i].size, GFP_KERNEL);
-      if (dump_tmp.regions[i].content == NULL) {
-        size_t j = 0;
-        for (; j < i; j++) {
-          kfree(dump_tmp.regions[j].content);
-        }
-        kfree(dump_tmp.regions);
-        printk(KERN_ALERT "/dev/krestore: Failed to allocate content\n");
-        return -ENOMEM;
-      }
-
-      if (copy_from_user(dump_tmp.regions[i].content, user_content,
-                         dump_tmp.regions[i].size) != 0) {
-        size_t j = 0;
-        for (; j < i; j++) {
-          kfree(dump_tmp.regions[j].content);
-        }
-        kfree(dump_tmp.regions[i].content);
-        kfree(dump_tmp.regions);
-        printk(KERN_ALERT "/dev/krestore: Failed to copy content from user\n");
-        return -EFAULT;
-      }
+    cond_resched();
+    size_t len = fill.size - done;
+    if (len > FILL_BUFFER_SIZE) {
+      len = FILL_BUFFER_SIZE;
+    }
+    if (copy_from_user(buffer, (const void __user *)(fill.src + done), len) !=
+            0 ||
+        copy_to_user((void __user *)(fill.dst + done), buffer, len) != 0) {
+      printk(KERN_ALERT "/dev/krestore: Failed to fill %llx-%llx\n",
+             fill.dst + done, fill.dst + done + len);
+      ret = -EFAULT;
+      break;
     }
-    printk(KERN_INFO "/dev/krestore: Copied region %zu\n", i);
+    done += len;
   }
-
-  *dump = dump_tmp; // copy back to the original dump
-
-  return 0;
+  kfree(buffer);
+  return ret;
 }
 
-static void free_process_dump(process_dump_t *dump) {
-  size_t i = 0;
-  for (; i < dump->num_regions; i++) {
-    if (dump->regions[i].content != NULL) {
-      kfree(dump->regions[i].content);
-    }
+static long restore_commit(struct krestore_session *session) {
+  if (!is_restoring(session)) {
+    return -EINVAL;
   }
-  kfree(dump->regions);
+  close_files(session);
+  session->state = COMMITTED;
+  printk(KERN_INFO "/dev/krestore: Restore committed -> COMMITTED\n");
+  return 0;
 }
 
 static int __init virtual_device_init(void) {
@@ -326,8 +397,6 @@ static int __init virtual_device_init(void) {
     return PTR_ERR(device_device);
   }
 
-  krestore_config.state = ENTRY;
-
   return 0;
 }
 
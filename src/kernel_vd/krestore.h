@@ -6,31 +6,73 @@
 #include <linux/device.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/ioctl.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/module.h>
 #include <linux/printk.h>
 #include <linux/ptrace.h>
+#include <linux/sched.h>
 #include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
 
+// Interface of the module, mirrored in include/krestore.h
+
+// Size of the scratch area of the process being restored, the only mapping of
+// its own KRESTORE_BEGIN keeps
+#define KRESTORE_SCRATCH_SIZE (256 * 1024)
+
+// Flags of a region
+#define KRESTORE_REGION_STACK (1U << 0)      // grows down
+#define KRESTORE_REGION_HUGE_PAGES (1U << 1) // backed by transparent huge pages
+
+// A region of the restored layout
 typedef struct {
-  unsigned long start;
-  unsigned long end;
-  char permissions[5]; // e.g., "rwxp"
-  char path[256];      // Path or descriptor (e.g., "[heap]")
-  unsigned long offset;
-  size_t size;
-  char *content;
-} memory_region_t;
-
-// Define a structure to hold the entire process state
+  uint64_t start;
+  uint64_t size;
+  uint64_t offset; // in the file
+  uint64_t path;   // address of the path of the file, 0 if anonymous
+  uint32_t prot;   // PROT_*
+  uint32_t flags;  // KRESTORE_REGION_*
+} krestore_region_t;
+
+// Regions mapped with one KRESTORE_MAP, in order. Adjacent anonymous regions
+// with the same protections and flags are mapped together.
 typedef struct {
-  size_t num_regions;
-  memory_region_t *regions;
-} process_dump_t;
+  uint64_t regions; // address of the krestore_region_t records
+  uint64_t num_regions;
+} krestore_map_t;
+
+// Contents copied from src to dst, both addresses of the restored process
+typedef struct {
+  uint64_t dst;
+  uint64_t src;
+  uint64_t size;
+} krestore_fill_t;
+
+#define KRESTORE_IOC_MAGIC 'k'
+// The argument is the address of the scratch area
+#define KRESTORE_BEGIN _IO(KRESTORE_IOC_MAGIC, 1)
+#define KRESTORE_MAP _IOW(KRESTORE_IOC_MAGIC, 2, krestore_map_t)
+#define KRESTORE_FILL _IOW(KRESTORE_IOC_MAGIC, 3, krestore_fill_t)
+#define KRESTORE_COMMIT _IO(KRESTORE_IOC_MAGIC, 4)
+
+// Size of the buffer KRESTORE_FILL copies the contents through
+#define FILL_BUFFER_SIZE PAGE_SIZE
+
+// Number of files kept open during a restore. The regions of a file are next
+// to each other in the layout, so few are enough.
+#define FILE_CACHE_SIZE 16
+
+// A file opened for the regions mapped from it
+struct cached_file {
+  char *path;
+  struct file *file;
+};
 
 // File operation functions
 static int device_open(struct inode *, struct file *);
@@ -41,18 +83,44 @@ static ssize_t device_read(struct file *, char *, size_t, loff_t *);
 
 static ssize_t device_write(struct file *, const char *, size_t, loff_t *);
 
-static int parse_dump_from_user(process_dump_t *dump, const char *buffer,
-                                size_t len);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
+
+// Unmap all regions of the current process except the kernel-related ones and
+// the scratch area at keep.
+static int unmap_all(unsigned long keep);
+
+// State of a restore, the private data of an open file of the device
+struct krestore_session;
+
+// Check that the caller is the process whose restore has begun
+static bool is_restoring(const struct krestore_session *session);
+
+// Steps of a restore, one per ioctl
+static long restore_begin(struct krestore_session *session,
+                          unsigned long scratch);
+
+static long restore_map(struct krestore_session *session,
+                        const krestore_map_t __user *user_map);
+
+static long restore_fill(struct krestore_session *session,
+                         const krestore_fill_t __user *user_fill);
+
+static long restore_commit(struct krestore_session *session);
 
-static void free_process_dump(process_dump_t *dump);
+// Map one region, or a run of adjacent anonymous regions if file is NULL
+static long map_region(struct file *file, unsigned long start,
+                       unsigned long size, unsigned long offset, uint32_t prot,
+                       uint32_t flags);
 
-// Unmmap all regions in the current user program except the kernel-related
-// ones.
-static int unmap_all(void);
+// Get the file at path from the cache of the restore, opened if not there yet
+static struct file *get_file(struct krestore_session *session,
+                             const char *path);
 
-static unsigned long parse_permissions(const char *permissions);
+// Close the files of the cache
+static void close_files(struct krestore_session *session);
 
-// Mmap all regions to the current user program except the kernel-related ones.
-static int map_all(const memory_region_t *regions, size_t num);
+// Mark the VMA at start as MADV_HUGEPAGE, so that its faults are served with
+// transparent huge pages
+static void advise_huge_pages(unsigned long start);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,150 @@
+#include "pagemap.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int open_pagemap(pid_t pid) {
+  char pagemap_path[256];
+  snprintf(pagemap_path, sizeof(pagemap_path), "/proc/%d/pagemap", pid);
+  int pagemap_fd = open(pagemap_path, O_RDONLY);
+  if (pagemap_fd == -1) {
+    perror("open pagemap");
+    return -1;
+  }
+  return pagemap_fd;
+}
+
+int read_pagemap(int pagemap_fd, unsigned long start, size_t num_pages,
+                 uint64_t *entries) {
+  // each page is described by one 64-bit entry indexed by its page number
+  size_t len = num_pages * sizeof(uint64_t);
+  off_t offset = (start / PAGE_SIZE) * sizeof(uint64_t);
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = pread(pagemap_fd, (char *)entries + done, len - done,
+                        offset + done);
+    if (ret <= 0) {
+      perror("pread pagemap");
+      return -1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+int append_page_run(page_runs_t *runs, unsigned long start,
+                    unsigned long end) {
+  // extend the previous run if contiguous
+  if (runs->num_runs > 0 && runs->runs[runs->num_runs - 1].end == start) {
+    runs->runs[runs->num_runs - 1].end = end;
+    return 0;
+  }
+  if (runs->num_runs >= runs->capacity) {
+    size_t new_capacity = runs->capacity ? runs->capacity * 2 : 20;
+    page_run_t *new_runs =
+        realloc(runs->runs, new_capacity * sizeof(page_run_t));
+    if (!new_runs) {
+      perror("realloc page runs");
+      return -1;
+    }
+    runs->runs = new_runs;
+    runs->capacity = new_capacity;
+  }
+  runs->runs[runs->num_runs].start = start;
+  runs->runs[runs->num_runs].end = end;
+  runs->num_runs++;
+  return 0;
+}
+
+int find_page_runs(int pagemap_fd, unsigned long start, unsigned long end,
+                   uint64_t mask, page_runs_t *runs) {
+  uint64_t entries[PAGEMAP_BATCH];
+  bool in_run = false;
+  unsigned long run_start = 0;
+  unsigned long addr = start;
+  while (addr < end) {
+    size_t num_pages = (end - addr) / PAGE_SIZE;
+    if (num_pages > PAGEMAP_BATCH) {
+      num_pages = PAGEMAP_BATCH;
+    }
+    if (read_pagemap(pagemap_fd, addr, num_pages, entries) == -1) {
+      return -1;
+    }
+    for (size_t i = 0; i < num_pages; i++) {
+      unsigned long page = addr + i * PAGE_SIZE;
+      if (entries[i] & mask) {
+        if (!in_run) {
+          run_start = page;
+          in_run = true;
+        }
+        runs->num_pages++;
+      } else if (in_run) {
+        if (append_page_run(runs, run_start, page) == -1) {
+          return -1;
+        }
+        in_run = false;
+      }
+    }
+    addr += num_pages * PAGE_SIZE;
+  }
+  if (in_run && append_page_run(runs, run_start, end) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+void free_page_runs(page_runs_t *runs) {
+  free(runs->runs);
+  runs->runs = NULL;
+  runs->num_runs = 0;
+  runs->capacity = 0;
+  runs->num_pages = 0;
+}
+
+int clear_soft_dirty(pid_t pid) {
+  char clear_refs_path[256];
+  snprintf(clear_refs_path, sizeof(clear_refs_path), "/proc/%d/clear_refs",
+           pid);
+  int clear_refs_fd = open(clear_refs_path, O_WRONLY);
+  if (clear_refs_fd == -1) {
+    perror("open clear_refs");
+    return -1;
+  }
+  // "4" clears the soft-dirty bits of all the process's pages
+  if (write(clear_refs_fd, "4", 1) != 1) {
+    perror("write clear_refs");
+    close(clear_refs_fd);
+    return -1;
+  }
+  close(clear_refs_fd);
+  return 0;
+}
+
+bool soft_dirty_supported(void) {
+  // without CONFIG_MEM_SOFT_DIRTY clear_refs accepts "4" but the bit is never
+  // set, so probe it on a page of our own
+  char *page = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    perror("mmap soft-dirty probe");
+    return false;
+  }
+  page[0] = 1;
+
+  bool supported = false;
+  int pagemap_fd = open_pagemap(getpid());
+  uint64_t entry;
+  if (pagemap_fd != -1 && clear_soft_dirty(getpid()) == 0) {
+    page[0] = 2;
+    if (read_pagemap(pagemap_fd, (unsigned long)page, 1, &entry) == 0) {
+      supported = (entry & PAGEMAP_SOFT_DIRTY) != 0;
+    }
+  }
+  if (pagemap_fd != -1) {
+    close(pagemap_fd);
+  }
+  munmap(page, PAGE_SIZE);
+  return supported;
+}
@@ -0,0 +1,251 @@
+#include "postcopy.h"
+#include "wire.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uffd_create(void) {
+  int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (uffd == -1) {
+    perror("userfaultfd");
+    return -1;
+  }
+
+  struct uffdio_api api = {.api = UFFD_API, .features = 0};
+  if (ioctl(uffd, UFFDIO_API, &api) == -1) {
+    perror("ioctl(UFFDIO_API)");
+    close(uffd);
+    return -1;
+  }
+  return uffd;
+}
+
+int send_fd(int unix_fd, int fd) {
+  char data = 0;
+  struct iovec iov = {.iov_base = &data, .iov_len = sizeof(data)};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(unix_fd, &msg, 0) == -1) {
+    perror("sendmsg fd");
+    return -1;
+  }
+  return 0;
+}
+
+int recv_fd(int unix_fd) {
+  char data;
+  struct iovec iov = {.iov_base = &data, .iov_len = sizeof(data)};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+  };
+  if (recvmsg(unix_fd, &msg, 0) <= 0) {
+    perror("recvmsg fd");
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "No file descriptor received\n");
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+int uffd_register_region(int uffd, unsigned long start, size_t size) {
+  struct uffdio_register reg = {
+      .range = {.start = start, .len = size},
+      .mode = UFFDIO_REGISTER_MODE_MISSING,
+  };
+  if (ioctl(uffd, UFFDIO_REGISTER, &reg) == -1) {
+    perror("ioctl(UFFDIO_REGISTER)");
+    return -1;
+  }
+  return 0;
+}
+
+int uffd_unregister_region(int uffd, unsigned long start, size_t size) {
+  struct uffdio_range range = {.start = start, .len = size};
+  if (ioctl(uffd, UFFDIO_UNREGISTER, &range) == -1) {
+    perror("ioctl(UFFDIO_UNREGISTER)");
+    return -1;
+  }
+  return 0;
+}
+
+int uffd_copy(int uffd, unsigned long start, const char *content,
+              size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    struct uffdio_copy copy = {
+        .dst = start + done,
+        .src = (unsigned long)(content + done),
+        .len = size - done,
+        .mode = 0,
+    };
+    if (ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+      break;
+    }
+    // copy.copy holds the bytes copied before the failure, or -errno
+    size_t copied = copy.copy > 0 ? copy.copy : 0;
+    if (errno == EEXIST) {
+      // the page was already filled by a request or by the pusher
+      done += copied + PAGE_SIZE;
+    } else if (errno == EAGAIN) {
+      done += copied;
+    } else {
+      perror("ioctl(UFFDIO_COPY)");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int uffd_zeropage(int uffd, unsigned long start, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    struct uffdio_zeropage zeropage = {
+        .range = {.start = start + done, .len = size - done},
+        .mode = 0,
+    };
+    if (ioctl(uffd, UFFDIO_ZEROPAGE, &zeropage) == 0) {
+      break;
+    }
+    // zeropage.zeropage holds the bytes mapped before the failure, or -errno
+    size_t mapped = zeropage.zeropage > 0 ? zeropage.zeropage : 0;
+    if (errno == EEXIST) {
+      done += mapped + PAGE_SIZE;
+    } else if (errno == EAGAIN) {
+      done += mapped;
+    } else {
+      perror("ioctl(UFFDIO_ZEROPAGE)");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int handle_page_faults(int uffd, int socket_fd) {
+  char *buf = malloc(POSTCOPY_CHUNK_SIZE);
+  if (!buf) {
+    perror("malloc page buffer");
+    return -1;
+  }
+
+  size_t num_faults = 0, received_bytes = 0;
+  bool done = false;
+  int ret = 0;
+  struct pollfd fds[2] = {
+      {.fd = uffd, .events = POLLIN},
+      {.fd = socket_fd, .events = POLLIN},
+  };
+  while (!done) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      ret = -1;
+      break;
+    }
+
+    // a thread of the restored process touched a missing page: request it
+    if (fds[0].revents & POLLIN) {
+      struct uffd_msg msg;
+      ssize_t len = read(uffd, &msg, sizeof(msg));
+      if (len == sizeof(msg) && msg.event == UFFD_EVENT_PAGEFAULT) {
+        unsigned long addr = msg.arg.pagefault.address & ~(PAGE_SIZE - 1);
+        if (send_all(socket_fd, &addr, sizeof(addr)) == -1) {
+          perror("send page request");
+          ret = -1;
+          break;
+        }
+        num_faults++;
+      } else if (len == -1 && errno != EAGAIN) {
+        perror("read userfaultfd");
+        ret = -1;
+        break;
+      }
+    } else if (fds[0].revents & (POLLERR | POLLHUP)) {
+      // the restored process exited
+      break;
+    }
+
+    // pages pushed by the source or requested above
+    if (fds[1].revents & POLLIN) {
+      unsigned long start;
+      size_t size;
+      if (recv_page_header(socket_fd, &start, &size) == -1) {
+        ret = -1;
+        break;
+      }
+      if (size == 0) {
+        done = true;
+        break;
+      }
+      if (size & PAGE_RECORD_ZERO) {
+        // zero pages are mapped without any copy
+        size = PAGE_RECORD_SIZE(size);
+        if (uffd_zeropage(uffd, start, size) == -1) {
+          ret = -1;
+          break;
+        }
+        received_bytes += size;
+        continue;
+      }
+      if (PAGE_RECORD_SIZE(size) > POSTCOPY_CHUNK_SIZE) {
+        fprintf(stderr, "Page record too large: %zu bytes\n",
+                PAGE_RECORD_SIZE(size));
+        ret = -1;
+        break;
+      }
+      if (recv_page_content(socket_fd, size, buf) == -1) {
+        ret = -1;
+        break;
+      }
+      size = PAGE_RECORD_SIZE(size);
+      if (uffd_copy(uffd, start, buf, size) == -1) {
+        ret = -1;
+        break;
+      }
+      received_bytes += size;
+    }
+  }
+
+  if (done) {
+    unsigned long request = POSTCOPY_DONE;
+    if (send_all(socket_fd, &request, sizeof(request)) == -1) {
+      perror("send done request");
+      ret = -1;
+    }
+  }
+  printf("Post-copy: %zu page faults, %zu bytes received\n", num_faults,
+         received_bytes);
+  free(buf);
+  return ret;
+}
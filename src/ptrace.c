@@ -1,34 +1,346 @@
 #include "ptrace.h"
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 
-int attach_process(pid_t pid) {
-  if (ptrace(PTRACE_ATTACH, pid, NULL, NULL) == -1) {
-    perror("ptrace(PTRACE_ATTACH)");
+uint64_t get_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int append_thread(threads_t *threads, pid_t tid) {
+  if (threads->num_threads >= threads->capacity) {
+    size_t new_capacity = threads->capacity ? threads->capacity * 2 : 16;
+    pid_t *new_tids = realloc(threads->tids, new_capacity * sizeof(pid_t));
+    if (!new_tids) {
+      perror("realloc threads");
+      return -1;
+    }
+    threads->tids = new_tids;
+    int *new_signals =
+        realloc(threads->signals, new_capacity * sizeof(int));
+    if (!new_signals) {
+      perror("realloc threads");
+      return -1;
+    }
+    threads->signals = new_signals;
+    threads->capacity = new_capacity;
+  }
+  threads->tids[threads->num_threads] = tid;
+  threads->signals[threads->num_threads] = 0;
+  threads->num_threads++;
+  return 0;
+}
+
+void free_threads(threads_t *threads) {
+  free(threads->tids);
+  free(threads->signals);
+  threads->tids = NULL;
+  threads->signals = NULL;
+  threads->num_threads = 0;
+  threads->capacity = 0;
+}
+
+static bool has_thread(const threads_t *threads, pid_t tid) {
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (threads->tids[i] == tid) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void remove_thread(threads_t *threads, size_t i) {
+  threads->num_threads--;
+  threads->tids[i] = threads->tids[threads->num_threads];
+  threads->signals[i] = threads->signals[threads->num_threads];
+}
+
+// Seize the threads of /proc/<pid>/task that are not in the list yet, and
+// interrupt them if interrupt is set. Returns the number of threads added.
+static long seize_new_threads(pid_t pid, threads_t *threads, bool interrupt) {
+  char task_path[64];
+  snprintf(task_path, sizeof(task_path), "/proc/%d/task", pid);
+  DIR *task_dir = opendir(task_path);
+  if (!task_dir) {
+    perror("opendir task");
     return -1;
   }
+  long num_new = 0;
+  struct dirent *entry;
+  while ((entry = readdir(task_dir)) != NULL) {
+    pid_t tid = atoi(entry->d_name);
+    if (tid <= 0 || has_thread(threads, tid)) {
+      continue;
+    }
+    if (ptrace(PTRACE_SEIZE, tid, NULL, NULL) == -1) {
+      // the thread exited since the directory was read
+      if (errno == ESRCH) {
+        continue;
+      }
+      perror("ptrace(PTRACE_SEIZE)");
+      num_new = -1;
+      break;
+    }
+    if (append_thread(threads, tid) == -1) {
+      ptrace(PTRACE_DETACH, tid, NULL, NULL);
+      num_new = -1;
+      break;
+    }
+    if (interrupt && ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1) {
+      perror("ptrace(PTRACE_INTERRUPT)");
+      num_new = -1;
+      break;
+    }
+    num_new++;
+  }
+  closedir(task_dir);
+  return num_new;
+}
+
+// Move the thread-group leader to the front of the list
+static int leader_first(pid_t pid, threads_t *threads) {
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (threads->tids[i] == pid) {
+      threads->tids[i] = threads->tids[0];
+      threads->tids[0] = pid;
+      int signal = threads->signals[i];
+      threads->signals[i] = threads->signals[0];
+      threads->signals[0] = signal;
+      return 0;
+    }
+  }
+  fprintf(stderr, "Process %d has exited.\n", pid);
+  return -1;
+}
 
-  // Wait for the target process to stop
-  int status;
-  if (waitpid(pid, &status, 0) == -1) {
-    perror("waitpid");
+int seize_process(pid_t pid, threads_t *threads) {
+  memset(threads, 0, sizeof(*threads));
+  if (seize_new_threads(pid, threads, false) == -1 ||
+      leader_first(pid, threads) == -1) {
+    detach_process(threads);
     return -1;
   }
+  return 0;
+}
 
-  // Check if the process stopped as expected
-  if (!WIFSTOPPED(status)) {
-    fprintf(stderr, "Process did not stop as expected.\n");
-    ptrace(PTRACE_DETACH, pid, NULL, NULL);
+// Wait until the threads from num_stopped on are stopped, forgetting the ones
+// that exit
+static int wait_stopped(threads_t *threads, size_t *num_stopped) {
+  while (*num_stopped < threads->num_threads) {
+    size_t i = *num_stopped;
+    int status;
+    if (waitpid(threads->tids[i], &status, __WALL) == -1) {
+      perror("waitpid");
+      return -1;
+    }
+    if (!WIFSTOPPED(status)) {
+      remove_thread(threads, i);
+      continue;
+    }
+    // a signal arrived before the interrupt, it is delivered on detach
+    if (status >> 16 != PTRACE_EVENT_STOP) {
+      threads->signals[i] = WSTOPSIG(status);
+    }
+    (*num_stopped)++;
+  }
+  return 0;
+}
+
+int freeze_process(pid_t pid, threads_t *threads) {
+  threads->freeze_start_ns = get_time_ns();
+
+  // All threads are interrupted before waiting for any, so that they stop
+  // concurrently. A running thread may have created threads: scan the tasks
+  // again until a scan finds none, when all known threads are stopped.
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (ptrace(PTRACE_INTERRUPT, threads->tids[i], NULL, NULL) == -1 &&
+        errno != ESRCH) {
+      perror("ptrace(PTRACE_INTERRUPT)");
+      detach_process(threads);
+      return -1;
+    }
+  }
+  size_t num_stopped = 0;
+  long num_new;
+  do {
+    if (wait_stopped(threads, &num_stopped) == -1) {
+      detach_process(threads);
+      return -1;
+    }
+    num_new = seize_new_threads(pid, threads, true);
+    if (num_new == -1) {
+      detach_process(threads);
+      return -1;
+    }
+  } while (num_new > 0);
+  if (leader_first(pid, threads) == -1) {
+    detach_process(threads);
     return -1;
   }
-  printf("Successfully attached to PID %d\n", pid);
 
+  threads->freeze_end_ns = get_time_ns();
+  printf("Stopped PID %d: %zu threads in %lu ns\n", pid,
+         threads->num_threads,
+         threads->freeze_end_ns - threads->freeze_start_ns);
   return 0;
 }
 
-int detach_process(pid_t pid) {
-  if (ptrace(PTRACE_DETACH, pid, NULL, NULL) == -1) {
-    perror("ptrace(PTRACE_DETACH)");
+int detach_process(threads_t *threads) {
+  int ret = 0;
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (ptrace(PTRACE_DETACH, threads->tids[i], NULL,
+               (void *)(long)threads->signals[i]) == -1) {
+      perror("ptrace(PTRACE_DETACH)");
+      ret = -1;
+    }
+  }
+  if (ret == 0 && threads->num_threads > 0) {
+    printf("Detached from PID %d (%zu threads)\n", threads->tids[0],
+           threads->num_threads);
+  }
+  free_threads(threads);
+  return ret;
+}
+
+// Kernel-internal return values of an interrupted system call, see
+// include/linux/errno.h
+#define ERESTARTSYS 512
+#define ERESTARTNOINTR 513
+#define ERESTARTNOHAND 514
+#define ERESTART_RESTARTBLOCK 516
+
+// Size of the syscall instruction
+#define SYSCALL_INSN_SIZE 2
+
+static int get_regset(pid_t pid, int type, void *buf, size_t *size) {
+  struct iovec iov = {.iov_base = buf, .iov_len = *size};
+  if (ptrace(PTRACE_GETREGSET, pid, (void *)(long)type, &iov) == -1) {
     return -1;
   }
-  printf("Detached from PID %d\n", pid);
+  // the kernel shrinks iov_len to the size of the regset
+  *size = iov.iov_len;
   return 0;
-}
\ No newline at end of file
+}
+
+static int set_regset(pid_t pid, int type, const void *buf, size_t size) {
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = size};
+  return ptrace(PTRACE_SETREGSET, pid, (void *)(long)type, &iov);
+}
+
+int get_cpu_state(pid_t pid, cpu_state_t *state) {
+  size_t size = sizeof(state->regs);
+  if (get_regset(pid, NT_PRSTATUS, &state->regs, &size) == -1) {
+    perror("ptrace(PTRACE_GETREGSET, NT_PRSTATUS)");
+    return -1;
+  }
+  size = sizeof(state->fpregs);
+  if (get_regset(pid, NT_PRFPREG, &state->fpregs, &size) == -1) {
+    perror("ptrace(PTRACE_GETREGSET, NT_PRFPREG)");
+    return -1;
+  }
+  state->xstate_size = sizeof(state->xstate);
+  if (get_regset(pid, NT_X86_XSTATE, state->xstate, &state->xstate_size) ==
+      -1) {
+    // no XSAVE, the x87/SSE state is all there is
+    if (errno != ENODEV) {
+      perror("ptrace(PTRACE_GETREGSET, NT_X86_XSTATE)");
+      return -1;
+    }
+    state->xstate_size = 0;
+  }
+  if (ptrace(PTRACE_GETSIGMASK, pid, sizeof(state->sigmask), &state->sigmask) ==
+      -1) {
+    perror("ptrace(PTRACE_GETSIGMASK)");
+    return -1;
+  }
+
+  // A system call interrupted by the stop is restarted by the kernel when the
+  // thread resumes, which does not carry over to the restored thread: rewind
+  // to the syscall instruction so that the thread issues the call again.
+  long ret = state->regs.rax;
+  if ((long)state->regs.orig_rax >= 0 &&
+      (ret == -ERESTARTSYS || ret == -ERESTARTNOINTR ||
+       ret == -ERESTARTNOHAND || ret == -ERESTART_RESTARTBLOCK)) {
+    state->regs.rax = state->regs.orig_rax;
+    state->regs.rip -= SYSCALL_INSN_SIZE;
+  }
+  return 0;
+}
+
+int set_cpu_state(pid_t pid, const cpu_state_t *state) {
+  if (set_regset(pid, NT_PRSTATUS, &state->regs, sizeof(state->regs)) == -1) {
+    perror("ptrace(PTRACE_SETREGSET, NT_PRSTATUS)");
+    return -1;
+  }
+  if (ptrace(PTRACE_SETSIGMASK, pid, sizeof(state->sigmask), &state->sigmask) ==
+      -1) {
+    perror("ptrace(PTRACE_SETSIGMASK)");
+    return -1;
+  }
+  // the kernel only takes a full XSAVE area of its own size
+  if (state->xstate_size > 0 &&
+      set_regset(pid, NT_X86_XSTATE, state->xstate, state->xstate_size) == 0) {
+    return 0;
+  }
+  if (state->xstate_size > 0) {
+    fprintf(stderr, "XSAVE layout differs, restoring x87/SSE state only\n");
+  }
+  if (set_regset(pid, NT_PRFPREG, &state->fpregs, sizeof(state->fpregs)) ==
+      -1) {
+    perror("ptrace(PTRACE_SETREGSET, NT_PRFPREG)");
+    return -1;
+  }
+  return 0;
+}
+
+int inject_syscall(pid_t pid, unsigned long stub, long nr,
+                   const unsigned long args[6], long *result) {
+  struct user_regs_struct regs;
+  if (ptrace(PTRACE_GETREGS, pid, NULL, &regs) == -1) {
+    perror("ptrace(PTRACE_GETREGS)");
+    return -1;
+  }
+  regs.rip = stub;
+  regs.rax = nr;
+  regs.orig_rax = -1; // not in a system call, nothing to restart
+  regs.rdi = args[0];
+  regs.rsi = args[1];
+  regs.rdx = args[2];
+  regs.r10 = args[3];
+  regs.r8 = args[4];
+  regs.r9 = args[5];
+  if (ptrace(PTRACE_SETREGS, pid, NULL, &regs) == -1) {
+    perror("ptrace(PTRACE_SETREGS)");
+    return -1;
+  }
+
+  // run the tracee to the entry of the system call, then to its exit
+  for (int stop = 0; stop < 2; stop++) {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1) {
+      perror("ptrace(PTRACE_SYSCALL)");
+      return -1;
+    }
+    int status;
+    if (waitpid(pid, &status, __WALL) == -1) {
+      perror("waitpid");
+      return -1;
+    }
+    if (!WIFSTOPPED(status) || WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+      fprintf(stderr, "Thread %d did not run the system call %ld\n", pid, nr);
+      return -1;
+    }
+  }
+  if (ptrace(PTRACE_GETREGS, pid, NULL, &regs) == -1) {
+    perror("ptrace(PTRACE_GETREGS)");
+    return -1;
+  }
+  *result = regs.rax;
+  return 0;
+}
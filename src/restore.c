@@ -1,14 +1,29 @@
+#define _GNU_SOURCE // clone
 #include "checkpoint.h"
+#include "image.h"
+#include "krestore.h"
+#include "postcopy.h"
 #include "ptrace.h"
+#include "vma.h"
+#include "wire.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/user.h>
@@ -16,84 +31,701 @@
 #include <time.h>
 #include <unistd.h>
 
-static long long get_time_ms() {
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  long long current_time = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-  return current_time;
+static bool is_kernel_region(const memory_region_t *region) {
+  return strstr(region->path, "[vvar]") || strstr(region->path, "[vsyscall]") ||
+         strstr(region->path, "[vdso]");
 }
 
-int recv_dump(process_dump_t *dump, int socket_fd) {
-  // Read the user struct
-  if (recv(socket_fd, &dump->user_dump, sizeof(struct user), 0) == -1) {
-    perror("recv user_dump");
+static bool has_content(const memory_region_t *region) {
+  // anonymous regions, except the ones provided by the kernel
+  return region->size > 0 &&
+         !(strlen(region->path) > 0 && strstr(region->path, "/")) &&
+         !is_kernel_region(region);
+}
+
+static bool map_from_image(const memory_dump_t *memory_dump,
+                           const memory_region_t *region) {
+  // The stack is copied so that it keeps growing down, and huge page regions
+  // so that they are populated with huge pages rather than file pages.
+  return memory_dump->image_path != NULL && region->image_offset != 0 &&
+         region->extents != NULL && !region->huge_pages &&
+         strcmp(region->path, "[stack]") != 0;
+}
+
+// Check if the contents of a region are written into the restored process
+static bool needs_fill(const memory_dump_t *memory_dump,
+                       const memory_region_t *region) {
+  return has_content(region) && !map_from_image(memory_dump, region);
+}
+
+static int parse_permissions(const char *permissions) {
+  int prot = PROT_NONE;
+  if (permissions[0] == 'r') {
+    prot |= PROT_READ;
+  }
+  if (permissions[1] == 'w') {
+    prot |= PROT_WRITE;
+  }
+  if (permissions[2] == 'x') {
+    prot |= PROT_EXEC;
+  }
+  return prot;
+}
+
+// A page of the pre-copy rounds
+typedef struct {
+  unsigned long addr;
+  int32_t hash_next; // next page of the same bucket
+  bool zero;         // last sent as a zero page, its contents are stale
+} staged_page_t;
+
+// The pages of the pre-copy rounds by address, with the latest contents of
+// each: a page sent again in a later round is overwritten in place
+typedef struct {
+  staged_page_t *pages;
+  char *data; // the contents of page i at i * PAGE_SIZE
+  size_t num_pages;
+  size_t capacity; // in pages
+  int32_t *buckets;
+  size_t num_buckets;
+} staged_pages_t;
+
+static void free_staged_pages(staged_pages_t *staged) {
+  free(staged->pages);
+  free(staged->data);
+  free(staged->buckets);
+  memset(staged, 0, sizeof(*staged));
+}
+
+static size_t hash_staged(const staged_pages_t *staged, unsigned long addr) {
+  return ((addr / PAGE_SIZE) * 0x9E3779B97F4A7C15UL) >> 32 &
+         (staged->num_buckets - 1);
+}
+
+static int32_t find_staged(const staged_pages_t *staged, unsigned long addr) {
+  if (staged->num_buckets == 0) {
     return -1;
   }
+  int32_t i = staged->buckets[hash_staged(staged, addr)];
+  while (i != -1 && staged->pages[i].addr != addr) {
+    i = staged->pages[i].hash_next;
+  }
+  return i;
+}
 
-  // Read the number of memory regions
-  if (recv(socket_fd, &dump->memory_dump.num_regions, sizeof(size_t), 0) ==
-      -1) {
-    perror("recv num_regions");
+// Double the capacity, the buckets are kept at most half full
+static int grow_staged(staged_pages_t *staged) {
+  size_t capacity = staged->capacity ? staged->capacity * 2 : 1024;
+  staged_page_t *pages = realloc(staged->pages, capacity * sizeof(*pages));
+  if (!pages) {
+    perror("realloc staged pages");
+    return -1;
+  }
+  staged->pages = pages;
+  char *data = realloc(staged->data, capacity * PAGE_SIZE);
+  if (!data) {
+    perror("realloc staged pages");
+    return -1;
+  }
+  staged->data = data;
+  size_t num_buckets = 2 * capacity;
+  int32_t *buckets = malloc(num_buckets * sizeof(*buckets));
+  if (!buckets) {
+    perror("malloc staged buckets");
     return -1;
   }
+  free(staged->buckets);
+  staged->buckets = buckets;
+  staged->num_buckets = num_buckets;
+  staged->capacity = capacity;
+  for (size_t b = 0; b < num_buckets; b++) {
+    buckets[b] = -1;
+  }
+  for (size_t i = 0; i < staged->num_pages; i++) {
+    size_t bucket = hash_staged(staged, pages[i].addr);
+    pages[i].hash_next = buckets[bucket];
+    buckets[bucket] = i;
+  }
+  return 0;
+}
 
-  // Allocate memory for the memory regions
-  dump->memory_dump.regions =
-      malloc(dump->memory_dump.num_regions * sizeof(memory_region_t));
-  if (!dump->memory_dump.regions) {
-    perror("malloc regions");
+// Function to get the slot of the page at addr, added if not staged yet
+static int32_t stage_page(staged_pages_t *staged, unsigned long addr) {
+  int32_t i = find_staged(staged, addr);
+  if (i != -1) {
+    return i;
+  }
+  if (staged->num_pages == staged->capacity && grow_staged(staged) == -1) {
+    return -1;
+  }
+  i = staged->num_pages++;
+  size_t bucket = hash_staged(staged, addr);
+  staged->pages[i].addr = addr;
+  staged->pages[i].hash_next = staged->buckets[bucket];
+  staged->buckets[bucket] = i;
+  return i;
+}
+
+static int stage_pages(staged_pages_t *staged, unsigned long start,
+                       const char *content, size_t size) {
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    int32_t i = stage_page(staged, start + offset);
+    if (i == -1) {
+      return -1;
+    }
+    staged->pages[i].zero = false;
+    memcpy(staged->data + (size_t)i * PAGE_SIZE, content + offset, PAGE_SIZE);
+  }
+  return 0;
+}
+
+static void stage_zero_pages(staged_pages_t *staged, unsigned long start,
+                             size_t size) {
+  // zero pages are not staged: the pages never staged are holes, which read
+  // as zeros once restored. Only the older copies become stale.
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    int32_t i = find_staged(staged, start + offset);
+    if (i != -1) {
+      staged->pages[i].zero = true;
+    }
+  }
+}
+
+static void copy_staged_page(const staged_pages_t *staged, unsigned long addr,
+                             char *page) {
+  // a page not staged, or last sent as a zero page, reads as zeros
+  int32_t i = find_staged(staged, addr);
+  if (i != -1 && !staged->pages[i].zero) {
+    memcpy(page, staged->data + (size_t)i * PAGE_SIZE, PAGE_SIZE);
+    return;
+  }
+  memset(page, 0, PAGE_SIZE);
+}
+
+static int recv_layout(int socket_fd, process_dump_t *dump) {
+  wire_layout_t layout;
+  if (recv_all(socket_fd, &layout, sizeof(layout)) == -1) {
+    perror("recv layout");
+    return -1;
+  }
+  if (le32toh(layout.magic) != WIRE_MAGIC ||
+      le32toh(layout.checksum) !=
+          wire_checksum(0, &layout, offsetof(wire_layout_t, checksum))) {
+    fprintf(stderr, "Corrupted layout header\n");
+    return -1;
+  }
+  size_t num_threads = le32toh(layout.num_threads);
+  size_t xstate_size = le32toh(layout.xstate_size);
+  if (le16toh(layout.version) != WIRE_VERSION ||
+      le16toh(layout.regs_size) != offsetof(cpu_state_t, xstate) ||
+      num_threads < 1 || num_threads > MAX_THREADS ||
+      xstate_size > XSTATE_MAX_SIZE) {
+    fprintf(stderr, "Unsupported layout version %u\n",
+            le16toh(layout.version));
+    return -1;
+  }
+
+  // read the registers, the region records and the string table at once. The
+  // checksum only protects against corruption, the sizes are bounded before
+  // anything is allocated for them: no source sends more mappings than it can
+  // list, nor more than one full path per region.
+  size_t num_regions = le32toh(layout.num_regions);
+  size_t strtab_size = le32toh(layout.strtab_size);
+  if (num_regions > VMA_TABLE_MAX_VMAS || strtab_size > VMA_TABLE_MAX_STRINGS ||
+      strtab_size > num_regions * sizeof(dump->memory_dump.regions->path)) {
+    fprintf(stderr, "Invalid layout: %zu regions, %zu bytes of paths\n",
+            num_regions, strtab_size);
     return -1;
   }
+  wire_region_t *records = malloc(num_regions * sizeof(*records));
+  char *strtab = malloc(strtab_size);
+  memory_region_t *regions = calloc(num_regions, sizeof(memory_region_t));
+  cpu_state_t *states = malloc(num_threads * sizeof(cpu_state_t));
+  int ret = -1;
+  if ((num_regions > 0 && (!records || !regions)) ||
+      (strtab_size > 0 && !strtab) || !states) {
+    perror("malloc layout");
+    goto free;
+  }
+  size_t state_size = offsetof(cpu_state_t, xstate) + xstate_size;
+  uint32_t payload_checksum = 0;
+  for (size_t i = 0; i < num_threads; i++) {
+    states[i].xstate_size = xstate_size;
+    if (recv_all(socket_fd, &states[i], state_size) == -1) {
+      perror("recv layout");
+      goto free;
+    }
+    payload_checksum = wire_checksum(payload_checksum, &states[i], state_size);
+  }
+  if (recv_all(socket_fd, records, num_regions * sizeof(*records)) == -1 ||
+      recv_all(socket_fd, strtab, strtab_size) == -1) {
+    perror("recv layout");
+    goto free;
+  }
+  payload_checksum = wire_checksum(payload_checksum, records,
+                                   num_regions * sizeof(*records));
+  payload_checksum = wire_checksum(payload_checksum, strtab, strtab_size);
+  if (payload_checksum != le32toh(layout.payload_checksum)) {
+    fprintf(stderr, "Corrupted layout\n");
+    goto free;
+  }
+
+  for (size_t i = 0; i < num_regions; i++) {
+    memory_region_t *region = &regions[i];
+    size_t path = le32toh(records[i].path);
+    size_t path_len = path < strtab_size
+                          ? strnlen(strtab + path, strtab_size - path)
+                          : strtab_size;
+    if (path >= strtab_size || path + path_len >= strtab_size ||
+        path_len >= sizeof(region->path)) {
+      fprintf(stderr, "Invalid path of region %zu\n", i);
+      goto free;
+    }
+    region->start = le64toh(records[i].start);
+    region->end = le64toh(records[i].end);
+    region->size = region->end - region->start;
+    region->offset = le64toh(records[i].offset);
+    memcpy(region->permissions, records[i].permissions,
+           sizeof(records[i].permissions));
+    region->permissions[sizeof(records[i].permissions)] = '\0';
+    memcpy(region->path, strtab + path, path_len + 1);
+    region->huge_pages =
+        (le32toh(records[i].flags) & WIRE_REGION_HUGE_PAGES) != 0;
+  }
+  dump->memory_dump.num_regions = num_regions;
+  dump->memory_dump.regions = regions;
+  dump->num_threads = num_threads;
+  dump->cpu_states = states;
+  regions = NULL;
+  states = NULL;
+  ret = 0;
+
+free:
+  free(states);
+  free(regions);
+  free(strtab);
+  free(records);
+  return ret;
+}
+
+typedef struct recv_state recv_state_t;
+
+typedef struct {
+  recv_state_t *state;
+  int socket_fd;
+  char *buf; // contents of the record being received
+  size_t buf_size;
+} recv_stream_t;
+
+struct recv_state {
+  staged_pages_t staged; // pages of the pre-copy rounds
+  const int *socket_fds;
+  int num_streams;
+  int arrived; // streams done with the current round
+  int round;
+  int at_layout; // streams waiting for the process to be mapped
+  bool mapped;   // the staged pages can be written into the process
+  int num_written; // streams done writing their share of the staged pages
+  size_t num_dropped; // staged pages no longer in the layout
+  int num_done;  // streams done with the last round
+  pid_t target;  // the restored process
+  process_dump_t *dump; // the layout, received by the thread of stream 0
+  bool failed;
+  int event_fd; // signalled when the layout is there, when all streams are
+                // done, and on failure
+  pthread_mutex_t lock;
+  pthread_cond_t round_done;
+  pthread_cond_t layout_done;
+  recv_stream_t streams[MAX_STREAMS];
+  pthread_t threads[MAX_STREAMS];
+  int num_started;
+  uint64_t received_ns; // when the last pages were received
+};
+
+// Wake up the event loop, with the lock of the state held
+static void notify_loop(recv_state_t *state) {
+  uint64_t one = 1;
+  if (write(state->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("write event");
+  }
+}
+
+static void fail_streams(recv_state_t *state) {
+  pthread_mutex_lock(&state->lock);
+  if (!state->failed) {
+    state->failed = true;
+    notify_loop(state);
+    // wake up the streams blocked in recv or waiting for the round to end
+    for (int i = 0; i < state->num_streams; i++) {
+      shutdown(state->socket_fds[i], SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&state->round_done);
+    pthread_cond_broadcast(&state->layout_done);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+static int wait_round(recv_state_t *state) {
+  // the pages of the next round may update pages of this one, all streams
+  // finish the round before any stages the next one
+  pthread_mutex_lock(&state->lock);
+  if (++state->arrived == state->num_streams) {
+    state->arrived = 0;
+    state->round++;
+    pthread_cond_broadcast(&state->round_done);
+  } else {
+    int round = state->round;
+    while (state->round == round && !state->failed) {
+      pthread_cond_wait(&state->round_done, &state->lock);
+    }
+  }
+  int ret = state->failed ? -1 : 0;
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+static int wait_layout(recv_state_t *state) {
+  // the last round is written into the process, which only exists once the
+  // layout that follows on stream 0 has been mapped
+  pthread_mutex_lock(&state->lock);
+  if (++state->at_layout == state->num_streams) {
+    notify_loop(state);
+  }
+  while (!state->mapped && !state->failed) {
+    pthread_cond_wait(&state->layout_done, &state->lock);
+  }
+  int ret = state->failed ? -1 : 0;
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+// The pages are copied straight into the restored process, whose regions are
+// writable until they are filled
+static int write_target(pid_t target, unsigned long addr, const char *buf,
+                        size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    struct iovec local = {.iov_base = (void *)(buf + done),
+                          .iov_len = len - done};
+    struct iovec remote = {.iov_base = (void *)(addr + done),
+                           .iov_len = len - done};
+    ssize_t ret = process_vm_writev(target, &local, 1, &remote, 1, 0);
+    if (ret <= 0) {
+      perror("process_vm_writev");
+      return -1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+static int read_target(pid_t target, unsigned long addr, char *buf,
+                       size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    struct iovec local = {.iov_base = buf + done, .iov_len = len - done};
+    struct iovec remote = {.iov_base = (void *)(addr + done),
+                           .iov_len = len - done};
+    ssize_t ret = process_vm_readv(target, &local, 1, &remote, 1, 0);
+    if (ret <= 0) {
+      perror("process_vm_readv");
+      return -1;
+    }
+    done += ret;
+  }
+  return 0;
+}
+
+static int zero_target_pages(const recv_state_t *state, unsigned long start,
+                             size_t size) {
+  // the regions are mapped empty, only the pages written from a pre-copy
+  // round must be cleared again
+  static const char zero_page[PAGE_SIZE];
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    int32_t i = find_staged(&state->staged, start + offset);
+    if (i != -1 && !state->staged.pages[i].zero &&
+        write_target(state->target, start + offset, zero_page, PAGE_SIZE) ==
+            -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// A record covers whole pages, at most a chunk of them, and a delta a single
+// page: the buffers are sized from the record, it must not be trusted
+static bool valid_record(unsigned long start, size_t size) {
+  size_t len = PAGE_RECORD_SIZE(size);
+  if (len == 0 || len > STREAM_CHUNK_SIZE || len % PAGE_SIZE != 0 ||
+      start % PAGE_SIZE != 0 ||
+      ((size & PAGE_RECORD_DELTA) && len != PAGE_SIZE)) {
+    fprintf(stderr, "Invalid page record: %zu bytes at %lx\n", len, start);
+    return false;
+  }
+  return true;
+}
 
-  // Read each memory region
-  for (size_t i = 0; i < dump->memory_dump.num_regions; i++) {
-    memory_region_t *region = &dump->memory_dump.regions[i];
+static int recv_into_target(recv_stream_t *stream, unsigned long start,
+                            size_t size) {
+  recv_state_t *state = stream->state;
+  size_t len = PAGE_RECORD_SIZE(size);
+  if (size & PAGE_RECORD_ZERO) {
+    return zero_target_pages(state, start, len);
+  }
+  // the buffer of the stream is reused by all the records
+  if (len > stream->buf_size) {
+    char *buf = realloc(stream->buf, len);
+    if (!buf) {
+      perror("realloc page record");
+      return -1;
+    }
+    stream->buf = buf;
+    stream->buf_size = len;
+  }
+  // a delta applies onto the contents already in the process
+  if ((size & PAGE_RECORD_DELTA) &&
+      read_target(state->target, start, stream->buf, len) == -1) {
+    return -1;
+  }
+  if (recv_page_content(stream->socket_fd, size, stream->buf) == -1) {
+    return -1;
+  }
+  return write_target(state->target, start, stream->buf, len);
+}
 
-    // Read the memory region metadata
-    if (recv(socket_fd, &region->start, sizeof(region->start), 0) == -1 ||
-        recv(socket_fd, &region->end, sizeof(region->end), 0) == -1 ||
-        recv(socket_fd, &region->size, sizeof(region->size), 0) == -1 ||
-        recv(socket_fd, &region->offset, sizeof(region->offset), 0) == -1 ||
-        recv(socket_fd, region->permissions, sizeof(region->permissions), 0) ==
-            -1 ||
-        recv(socket_fd, region->path, sizeof(region->path), 0) == -1) {
-      perror("recv region metadata");
+// Write count pages, one per iovec, with as few syscalls as possible
+static int write_target_pages(pid_t target, const struct iovec *local,
+                              const struct iovec *remote, size_t count) {
+  size_t i = 0;
+  while (i < count) {
+    ssize_t ret = process_vm_writev(target, local + i, count - i, remote + i,
+                                    count - i, 0);
+    if (ret <= 0) {
+      perror("process_vm_writev");
       return -1;
     }
+    // a short write is retried from the page it stopped in
+    i += ret / PAGE_SIZE;
+  }
+  return 0;
+}
+
+// Find the region of the layout, sorted by address, that holds addr
+static const memory_region_t *find_region(const memory_dump_t *memory_dump,
+                                          unsigned long addr) {
+  size_t lo = 0, hi = memory_dump->num_regions;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const memory_region_t *region = &memory_dump->regions[mid];
+    if (addr < region->start) {
+      hi = mid;
+    } else if (addr >= region->end) {
+      lo = mid + 1;
+    } else {
+      return region;
+    }
+  }
+  return NULL;
+}
 
-    // Read the memory content
-    if (region->size > 0 &&
-        !(strlen(region->path) > 0 && strstr(region->path, "/")) &&
-        !(strstr(region->path, "[vvar]") ||
-          strstr(region->path, "[vsyscall]") ||
-          strstr(region->path, "[vdso]"))) {
-      region->content = malloc(region->size);
-      if (!region->content) {
-        perror("malloc region content");
+// Write the share of a stream of the staged pages of the pre-copy rounds into
+// the process, IOV_MAX at a time. All the streams write theirs before any
+// receives the last round into the process. Only the addresses of the staged
+// pages are kept, to clear the ones the last round sends as zeros.
+static int write_staged(recv_stream_t *stream) {
+  recv_state_t *state = stream->state;
+  staged_pages_t *staged = &state->staged;
+  const memory_dump_t *memory_dump = &state->dump->memory_dump;
+  size_t index = stream - state->streams;
+  size_t begin = staged->num_pages * index / state->num_streams;
+  size_t end = staged->num_pages * (index + 1) / state->num_streams;
+  struct iovec local[IOV_MAX], remote[IOV_MAX];
+  size_t count = 0, num_dropped = 0;
+  for (size_t i = begin; i < end; i++) {
+    // The process may have unmapped or remapped memory since a pre-copy
+    // round, e.g. a heap trimmed by free(): only the pages still in a region
+    // that is filled are written, the others are stale.
+    const memory_region_t *region =
+        find_region(memory_dump, staged->pages[i].addr);
+    if (!staged->pages[i].zero &&
+        (!region || !needs_fill(memory_dump, region))) {
+      staged->pages[i].zero = true;
+      num_dropped++;
+    }
+    if (!staged->pages[i].zero) {
+      local[count].iov_base = staged->data + i * PAGE_SIZE;
+      local[count].iov_len = PAGE_SIZE;
+      remote[count].iov_base = (void *)staged->pages[i].addr;
+      remote[count].iov_len = PAGE_SIZE;
+      count++;
+    }
+    if ((count == IOV_MAX || i + 1 == end) && count > 0) {
+      if (write_target_pages(state->target, local, remote, count) == -1) {
         return -1;
       }
+      count = 0;
+    }
+  }
+
+  pthread_mutex_lock(&state->lock);
+  state->num_dropped += num_dropped;
+  if (++state->num_written == state->num_streams) {
+    free(staged->data);
+    staged->data = NULL;
+    pthread_cond_broadcast(&state->layout_done);
+  }
+  while (state->num_written < state->num_streams && !state->failed) {
+    pthread_cond_wait(&state->layout_done, &state->lock);
+  }
+  int ret = state->failed ? -1 : 0;
+  pthread_mutex_unlock(&state->lock);
+  return ret;
+}
+
+// The process is mapped: the streams write the staged pages into it, then the
+// last round
+static void start_filling(recv_state_t *state, pid_t target) {
+  pthread_mutex_lock(&state->lock);
+  state->target = target;
+  state->mapped = true;
+  pthread_cond_broadcast(&state->layout_done);
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void *recv_pages(void *arg) {
+  recv_stream_t *stream = arg;
+  recv_state_t *state = stream->state;
+  bool into_target = false; // the last round goes to the process
 
-      // TCP will send in multiple chunks
-      size_t received = 0;
-      while (received < region->size) {
-        ssize_t ret = recv(socket_fd, region->content + received,
-                           region->size - received, 0);
-        if (ret == -1) {
-          perror("recv region content");
-          return -1;
+  // Read the page records of all rounds until the empty record of the last
+  while (1) {
+    unsigned long start;
+    size_t size;
+    if (recv_page_header(stream->socket_fd, &start, &size) == -1) {
+      goto fail;
+    }
+    if (size == 0) {
+      if (start == PAGE_RECORD_LAYOUT) {
+        // the layout follows on the first stream once all of them are done
+        // with the pre-copy rounds
+        if (stream == state->streams &&
+            recv_layout(stream->socket_fd, state->dump) == -1) {
+          goto fail;
+        }
+        if (wait_layout(state) == -1) {
+          return (void *)-1L;
+        }
+        if (write_staged(stream) == -1) {
+          goto fail;
         }
-        received += ret;
+        into_target = true;
+        continue;
       }
-
-    } else {
-      region->content = NULL;
+      if (start != PAGE_RECORD_MORE_ROUNDS) {
+        break; // the last round is done
+      }
+      if (wait_round(state) == -1) {
+        return (void *)-1L;
+      }
+      continue;
+    }
+    if (!valid_record(start, size)) {
+      goto fail;
+    }
+    // the earlier rounds are staged until the process exists
+    if (into_target) {
+      if (recv_into_target(stream, start, size) == -1) {
+        goto fail;
+      }
+      continue;
+    }
+    if (size & PAGE_RECORD_ZERO) {
+      pthread_mutex_lock(&state->lock);
+      stage_zero_pages(&state->staged, start, PAGE_RECORD_SIZE(size));
+      pthread_mutex_unlock(&state->lock);
+      continue;
     }
+    // decompression, if any, runs in parallel in the stream threads
+    size_t len = PAGE_RECORD_SIZE(size);
+    if (len > stream->buf_size) {
+      char *buf = realloc(stream->buf, len);
+      if (!buf) {
+        perror("realloc page record");
+        goto fail;
+      }
+      stream->buf = buf;
+      stream->buf_size = len;
+    }
+    // a delta applies onto the contents received in an earlier round
+    if (size & PAGE_RECORD_DELTA) {
+      pthread_mutex_lock(&state->lock);
+      copy_staged_page(&state->staged, start, stream->buf);
+      pthread_mutex_unlock(&state->lock);
+    }
+    if (recv_page_content(stream->socket_fd, size, stream->buf) == -1) {
+      goto fail;
+    }
+    pthread_mutex_lock(&state->lock);
+    int ret = stage_pages(&state->staged, start, stream->buf, len);
+    pthread_mutex_unlock(&state->lock);
+    if (ret == -1) {
+      goto fail;
+    }
+  }
+  pthread_mutex_lock(&state->lock);
+  if (++state->num_done == state->num_streams) {
+    state->received_ns = get_time_ns();
+    notify_loop(state);
+  }
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
 
-    printf("Recv Region %zu: %lx-%lx (%s) %s (offset=%lx), size: %zu\n", i,
-           region->start, region->end, region->permissions, region->path,
-           region->offset, region->size);
+fail:
+  fail_streams(state);
+  return (void *)-1L;
+}
+
+static int join_streams(recv_state_t *state) {
+  for (int i = 0; i < state->num_started; i++) {
+    void *recv_ret;
+    pthread_join(state->threads[i], &recv_ret);
+    if (recv_ret != NULL) {
+      state->failed = true;
+    }
+    free(state->streams[i].buf);
   }
+  state->num_started = 0;
+  pthread_cond_destroy(&state->layout_done);
+  pthread_cond_destroy(&state->round_done);
+  pthread_mutex_destroy(&state->lock);
+  free_staged_pages(&state->staged);
+  return state->failed ? -1 : 0;
+}
 
+static int start_streams(recv_state_t *state, const int *socket_fds,
+                         int num_streams, process_dump_t *dump,
+                         int event_fd) {
+  // Receive the pages of the pre-copy rounds from all streams in parallel,
+  // each stream staging its records by address
+  memset(state, 0, sizeof(*state));
+  state->socket_fds = socket_fds;
+  state->num_streams = num_streams;
+  state->dump = dump;
+  state->event_fd = event_fd;
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->round_done, NULL);
+  pthread_cond_init(&state->layout_done, NULL);
+  for (; state->num_started < num_streams; state->num_started++) {
+    recv_stream_t *stream = &state->streams[state->num_started];
+    stream->state = state;
+    stream->socket_fd = socket_fds[state->num_started];
+    if (pthread_create(&state->threads[state->num_started], NULL, recv_pages,
+                       stream) != 0) {
+      perror("pthread_create");
+      fail_streams(state);
+      return -1;
+    }
+  }
   return 0;
 }
 
@@ -175,132 +807,767 @@ static void print_mappings(pid_t pid) {
   fclose(maps_file);
 }
 
-int tracer(pid_t child, bool step_by_step,
-           const struct user_regs_struct *regs_dump) {
-  int status;
-  if (waitpid(child, &status, 0) == -1) {
-    perror("waitpid");
-    return EXIT_FAILURE;
-  }
-  if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP) {
-    printf("Child stopped by SIGSTOP\n");
-  } else if (WIFEXITED(status)) {
-    printf("Child exited with status %d\n", WEXITSTATUS(status));
-    return EXIT_FAILURE;
-  } else {
-    fprintf(stderr, "Child stopped by signal %d\n", WSTOPSIG(status));
-    return EXIT_FAILURE;
+static int register_lazy_regions(int uffd, const memory_dump_t *memory_dump) {
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    if (has_content(region) &&
+        uffd_register_region(uffd, region->start, region->size) == -1) {
+      return -1;
+    }
   }
+  return 0;
+}
 
-  while (1) {
-    // inspect syscall entry
-    if (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == -1) {
-      perror("ptrace(PTRACE_SYSCALL)");
-      return EXIT_FAILURE;
+static void unregister_lazy_regions(int uffd,
+                                    const memory_dump_t *memory_dump) {
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    if (has_content(region)) {
+      uffd_unregister_region(uffd, region->start, region->size);
     }
-    if (waitpid(child, &status, 0) == -1) {
-      perror("waitpid");
-      return EXIT_FAILURE;
+  }
+}
+
+// The restored process once krestore has unmapped its memory: the tracer runs
+// the next steps of the restore from the syscall instruction at the start of
+// its scratch area
+typedef struct {
+  pid_t pid;
+  int device_fd; // its descriptor of the krestore device
+  unsigned long scratch;
+} restoree_t;
+
+// Arguments of the system calls run in the restored process are put after the
+// syscall instruction of its scratch area
+#define SCRATCH_ARGS_OFFSET PAGE_SIZE
+
+static const unsigned char syscall_insn[] = {0x0f, 0x05};
+
+static bool has_thread(const threads_t *threads, pid_t tid) {
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (threads->tids[i] == tid) {
+      return true;
     }
+  }
+  return false;
+}
 
-    // inspect syscall exit
-    if (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == -1) {
-      perror("ptrace(PTRACE_SYSCALL)");
-      return EXIT_FAILURE;
+// A stop waited for before its tracee is known: a new thread may stop before
+// the clone event of its parent, and the other tracees, workers and processes
+// being restored, stop for their signals
+typedef struct {
+  pid_t pid;
+  int status;
+} pending_stop_t;
+
+typedef struct {
+  pending_stop_t *stops;
+  size_t num_stops;
+  size_t capacity;
+} pending_stops_t;
+
+static int add_pending_stop(pending_stops_t *pending, pid_t pid, int status) {
+  if (pending->num_stops == pending->capacity) {
+    size_t capacity = pending->capacity ? pending->capacity * 2 : 16;
+    pending_stop_t *stops =
+        realloc(pending->stops, capacity * sizeof(*stops));
+    if (!stops) {
+      perror("realloc pending stops");
+      return -1;
     }
-    if (waitpid(child, &status, 0) == -1) {
-      perror("waitpid");
-      return EXIT_FAILURE;
+    pending->stops = stops;
+    pending->capacity = capacity;
+  }
+  pending->stops[pending->num_stops++] =
+      (pending_stop_t){.pid = pid, .status = status};
+  return 0;
+}
+
+// Function to take the pending stop of tid, if any
+static bool take_pending_stop(pending_stops_t *pending, pid_t tid) {
+  for (size_t i = 0; i < pending->num_stops; i++) {
+    if (pending->stops[i].pid == tid) {
+      pending->stops[i] = pending->stops[--pending->num_stops];
+      return true;
     }
+  }
+  return false;
+}
+
+// Let a tracee that is not part of the restore go, with the signal it stopped
+// for
+static void resume_stop(const pending_stop_t *stop) {
+  int signal = 0;
+  if (stop->status >> 16 == 0 && WSTOPSIG(stop->status) != (SIGTRAP | 0x80)) {
+    signal = WSTOPSIG(stop->status);
+  }
+  if (ptrace(PTRACE_CONT, stop->pid, NULL, (void *)(long)signal) == -1 &&
+      errno != ESRCH) {
+    perror("ptrace(PTRACE_CONT)");
+  }
+}
+
+static void resume_pending_stops(pending_stops_t *pending) {
+  for (size_t i = 0; i < pending->num_stops; i++) {
+    resume_stop(&pending->stops[i]);
+  }
+  pending->num_stops = 0;
+}
+
+// The handoff of a claimed worker, already running, until its ioctl that
+// begins the restore returns. The threads it clones on the way are added to
+// threads and left in their initial stop. The child runs freely up to the
+// SIGSTOP it raises right before the ioctl, then its system calls are followed
+// to the exit of the ioctl, the next one.
+typedef struct {
+  pid_t child;
+  threads_t *threads;
+  restoree_t *proc;
+  size_t num_stopped;
+  int request;
+  bool in_syscall; // between the entry and exit stops of a system call
+  bool in_begin;   // and that system call is the ioctl
+  bool restored;
+} handoff_t;
+
+static int begin_handoff(handoff_t *handoff, pid_t child, threads_t *threads,
+                         restoree_t *proc) {
+  memset(threads, 0, sizeof(*threads));
+  *handoff = (handoff_t){
+      .child = child,
+      .threads = threads,
+      .proc = proc,
+      .num_stopped = 1, // the child itself
+      .request = PTRACE_CONT,
+  };
+  return append_thread(threads, child);
+}
 
+static bool in_handoff(const handoff_t *handoff, pid_t pid) {
+  return has_thread(handoff->threads, pid);
+}
+
+// Move the handoff on with a state change of one of its threads. The stops of
+// its new threads that came before their clone event are taken from pending.
+// Returns 1 once the ioctl returned and all threads are stopped, 0 while the
+// handoff goes on, -1 on failure.
+static int on_handoff_stop(handoff_t *handoff, pid_t pid, int status,
+                           pending_stops_t *pending) {
+  pid_t child = handoff->child;
+  if (!WIFSTOPPED(status)) {
+    fprintf(stderr, "Thread %d exited during the restore\n", pid);
+    return -1;
+  }
+  if (pid != child) {
+    handoff->num_stopped++;
+  } else if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_CLONE << 8))) {
+    unsigned long tid;
+    if (ptrace(PTRACE_GETEVENTMSG, child, NULL, &tid) == -1) {
+      perror("ptrace(PTRACE_GETEVENTMSG)");
+      return -1;
+    }
+    if (append_thread(handoff->threads, tid) == -1) {
+      return -1;
+    }
+    if (take_pending_stop(pending, tid)) {
+      handoff->num_stopped++;
+    }
+  } else if (status >> 16 == 0 && WSTOPSIG(status) == SIGSTOP) {
+    // the ioctl that unmaps the memory of the child comes next, the SIGSTOP
+    // is not delivered
+    handoff->request = PTRACE_SYSCALL;
+  } else if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
     struct user_regs_struct regs;
     if (ptrace(PTRACE_GETREGS, child, NULL, &regs) == -1) {
       perror("ptrace(PTRACE_GETREGS)");
-      return EXIT_FAILURE;
+      return -1;
     }
-    unsigned long orig_rax = regs.orig_rax;
-    if (orig_rax == SYS_write) {
-      break;
+    // the system calls left of raise() run through
+    handoff->in_syscall = !handoff->in_syscall;
+    if (handoff->in_syscall) {
+      handoff->in_begin = regs.orig_rax == SYS_ioctl &&
+                          (unsigned int)regs.rsi == KRESTORE_BEGIN;
+    } else if (handoff->in_begin) {
+      if ((long)regs.rax < 0) {
+        fprintf(stderr, "krestore failed: %s\n", strerror(-regs.rax));
+        return -1;
+      }
+      handoff->proc->pid = child;
+      handoff->proc->device_fd = regs.rdi;
+      handoff->proc->scratch = regs.rdx;
+      handoff->restored = true;
     }
   }
+  if (pid == child && !handoff->restored &&
+      ptrace(handoff->request, child, NULL, NULL) == -1) {
+    perror("ptrace(PTRACE_CONT)");
+    return -1;
+  }
+  return handoff->restored &&
+         handoff->num_stopped == handoff->threads->num_threads;
+}
 
-  print_mappings(child);
-
-  // restore user registers
-  if (ptrace(PTRACE_SETREGS, child, NULL, regs_dump) == -1) {
-    perror("ptrace(PTRACE_SETREGS)");
-    return EXIT_FAILURE;
+// Run the handoff to its end, waiting for the stops. The stops of the other
+// tracees are let go.
+static int run_to_restore(handoff_t *handoff) {
+  pending_stops_t pending;
+  memset(&pending, 0, sizeof(pending));
+  int ret = 0;
+  while (ret == 0) {
+    // wait for the next stop of the child, or of a new thread
+    int status;
+    pid_t pid = waitpid(-1, &status, __WALL);
+    if (pid == -1) {
+      perror("waitpid");
+      ret = -1;
+    } else if (in_handoff(handoff, pid)) {
+      ret = on_handoff_stop(handoff, pid, status, &pending);
+    } else if (WIFSTOPPED(status) &&
+               add_pending_stop(&pending, pid, status) == -1) {
+      ret = -1;
+    }
+    // the processes restored before and the workers are children too, their
+    // exits are ignored
   }
+  resume_pending_stops(&pending);
+  free(pending.stops);
+  return ret == -1 ? -1 : 0;
+}
 
-  if (step_by_step) {
-    inspect_step_by_step(child);
+static int run_syscall(const restoree_t *proc, long nr, unsigned long arg0,
+                       unsigned long arg1, unsigned long arg2) {
+  unsigned long args[6] = {arg0, arg1, arg2, 0, 0, 0};
+  long ret;
+  if (inject_syscall(proc->pid, proc->scratch, nr, args, &ret) == -1) {
+    return -1;
+  }
+  if (ret < 0) {
+    fprintf(stderr, "System call %ld of the restore failed: %s\n", nr,
+            strerror(-ret));
+    return -1;
   }
+  return 0;
+}
 
-  detach_process(child);
+// Size of the records of a KRESTORE_MAP and their paths in the scratch area
+#define MAP_BATCH_SIZE (KRESTORE_SCRATCH_SIZE - SCRATCH_ARGS_OFFSET)
 
-  long long end_time = get_time_ms();
-  printf("migration end time: %lld ms\n", end_time);
-  return EXIT_SUCCESS;
+// Regions mapped with one KRESTORE_MAP, built here then written to the scratch
+// area of the process: the records from its start and their paths from its
+// end
+typedef struct {
+  char *buf;
+  size_t num_regions;
+  size_t paths_size;
+  const char *last_path; // the paths of consecutive regions are stored once
+  uint64_t last_path_addr;
+} map_batch_t;
+
+static krestore_region_t *batch_regions(const map_batch_t *batch) {
+  return (krestore_region_t *)(batch->buf + sizeof(krestore_map_t));
 }
 
-int tracee(const memory_dump_t *memory_dump) {
-  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
-    perror("ptrace(PTRACE_TRACEME)");
-    return EXIT_FAILURE;
+static int flush_batch(const restoree_t *proc, map_batch_t *batch) {
+  if (batch->num_regions == 0) {
+    return 0;
   }
-  raise(SIGSTOP);
-
-  int restorer_fd = open("/dev/krestore_mapping", O_WRONLY);
-  if (restorer_fd == -1) {
-    perror("open restorer_fd");
-    return EXIT_FAILURE;
+  unsigned long args = proc->scratch + SCRATCH_ARGS_OFFSET;
+  krestore_map_t *map = (krestore_map_t *)batch->buf;
+  map->regions = args + sizeof(*map);
+  map->num_regions = batch->num_regions;
+  size_t records_size =
+      sizeof(*map) + batch->num_regions * sizeof(krestore_region_t);
+  size_t paths_offset = MAP_BATCH_SIZE - batch->paths_size;
+  struct iovec local[2] = {
+      {.iov_base = batch->buf, .iov_len = records_size},
+      {.iov_base = batch->buf + paths_offset, .iov_len = batch->paths_size},
+  };
+  struct iovec remote[2] = {
+      {.iov_base = (void *)args, .iov_len = records_size},
+      {.iov_base = (void *)(args + paths_offset),
+       .iov_len = batch->paths_size},
+  };
+  if (process_vm_writev(proc->pid, local, 2, remote, 2, 0) !=
+      (ssize_t)(records_size + batch->paths_size)) {
+    perror("process_vm_writev regions");
+    return -1;
   }
+  batch->num_regions = 0;
+  batch->paths_size = 0;
+  batch->last_path = NULL;
+  return run_syscall(proc, SYS_ioctl, proc->device_fd, KRESTORE_MAP, args);
+}
 
-  if (write(restorer_fd, memory_dump, sizeof(*memory_dump)) == -1) {
-    perror("write memory_dump");
-    return EXIT_FAILURE;
+static int add_region(const restoree_t *proc, map_batch_t *batch,
+                      unsigned long start, size_t size, unsigned long offset,
+                      const char *path, int prot, unsigned int flags) {
+  bool new_path = path && (!batch->last_path ||
+                           strcmp(path, batch->last_path) != 0);
+  size_t path_size = new_path ? strlen(path) + 1 : 0;
+  size_t records_size =
+      sizeof(krestore_map_t) + batch->num_regions * sizeof(krestore_region_t);
+  if (records_size + sizeof(krestore_region_t) + batch->paths_size +
+          path_size >
+      MAP_BATCH_SIZE) {
+    if (flush_batch(proc, batch) == -1) {
+      return -1;
+    }
+    return add_region(proc, batch, start, size, offset, path, prot, flags);
   }
-
-  assert(0); // should not reach here
+  if (new_path) {
+    batch->paths_size += path_size;
+    memcpy(batch->buf + MAP_BATCH_SIZE - batch->paths_size, path, path_size);
+    batch->last_path = path;
+    batch->last_path_addr = proc->scratch + SCRATCH_ARGS_OFFSET +
+                            MAP_BATCH_SIZE - batch->paths_size;
+  }
+  batch_regions(batch)[batch->num_regions++] = (krestore_region_t){
+      .start = start,
+      .size = size,
+      .offset = offset,
+      .path = path ? batch->last_path_addr : 0,
+      .prot = prot,
+      .flags = flags,
+  };
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  // Usage: ./restore <listen port> [-f <file path>] [-s]
-  int opt;
-  char *log_filename = NULL;
-  int log_fd = -1;
-  bool step_by_step = false;
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s <listen port> [-f <file path>] [-s]\n", argv[0]);
+// Map the regions of the layout with as few KRESTORE_MAP as their records fit
+// in. The anonymous regions are mapped empty and writable, their contents are
+// written afterwards. The extents of the image are mapped over them once they
+// are all mapped, so that the module can merge adjacent anonymous regions.
+static int map_regions(const restoree_t *proc,
+                       const memory_dump_t *memory_dump) {
+  map_batch_t batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.buf = malloc(MAP_BATCH_SIZE);
+  if (!batch.buf) {
+    perror("malloc regions");
+    return -1;
+  }
+  int ret = 0;
+  for (size_t i = 0; i < memory_dump->num_regions && ret == 0; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    if (is_kernel_region(region)) {
+      continue;
+    }
+    int prot = parse_permissions(region->permissions);
+    unsigned int flags = 0;
+    if (strcmp(region->path, "[stack]") == 0) {
+      flags |= KRESTORE_REGION_STACK;
+    }
+    if (region->huge_pages) {
+      flags |= KRESTORE_REGION_HUGE_PAGES;
+    }
+
+    // file-backed regions
+    if (!has_content(region)) {
+      ret = add_region(proc, &batch, region->start, region->size,
+                       region->offset, region->path, prot, flags);
+      continue;
+    }
+    if (needs_fill(memory_dump, region)) {
+      prot |= PROT_WRITE;
+    }
+    ret = add_region(proc, &batch, region->start, region->size, 0, NULL, prot,
+                     flags);
+  }
+
+  // Anonymous regions from an image: the extents are private mappings of the
+  // image, read in when touched and copied on the first write, over the
+  // anonymous mapping for the holes.
+  for (size_t i = 0; i < memory_dump->num_regions && ret == 0; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    if (!map_from_image(memory_dump, region)) {
+      continue;
+    }
+    int prot = parse_permissions(region->permissions);
+    unsigned long file_offset = region->image_offset;
+    for (size_t j = 0; j < region->num_extents && ret == 0; j++) {
+      const page_extent_t *extent = &region->extents[j];
+      ret = add_region(proc, &batch, region->start + extent->offset,
+                       extent->size, file_offset, memory_dump->image_path,
+                       prot, 0);
+      file_offset += extent->size;
+    }
+  }
+  if (ret == 0) {
+    ret = flush_batch(proc, &batch);
+  }
+  free(batch.buf);
+  return ret;
+}
+
+// Write the contents of the regions loaded from an image that are not mapped
+// from it
+static int fill_from_image(pid_t target, const memory_dump_t *memory_dump) {
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    if (!needs_fill(memory_dump, region) || region->content == NULL) {
+      continue;
+    }
+    if (region->extents == NULL) {
+      if (write_target(target, region->start, region->content,
+                       region->size) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    const char *content = region->content;
+    for (size_t j = 0; j < region->num_extents; j++) {
+      const page_extent_t *extent = &region->extents[j];
+      if (write_target(target, region->start + extent->offset, content,
+                       extent->size) == -1) {
+        return -1;
+      }
+      content += extent->size;
+    }
+  }
+  return 0;
+}
+
+// Set the protections of the filled regions that are not writable, then end
+// the restore and remove the traces of the restorer: the krestore device and
+// the scratch area
+static int commit_restore(const restoree_t *proc,
+                          const memory_dump_t *memory_dump) {
+  // one mprotect for each run of adjacent regions with the same protections
+  unsigned long run_start = 0, run_end = 0;
+  int run_prot = 0;
+  for (size_t i = 0; i <= memory_dump->num_regions; i++) {
+    const memory_region_t *region = NULL;
+    int prot = 0;
+    if (i < memory_dump->num_regions) {
+      region = &memory_dump->regions[i];
+      prot = parse_permissions(region->permissions);
+      if (!needs_fill(memory_dump, region) || (prot & PROT_WRITE)) {
+        continue;
+      }
+      if (region->start == run_end && prot == run_prot) {
+        run_end = region->end;
+        continue;
+      }
+    }
+    if (run_end != 0 &&
+        run_syscall(proc, SYS_mprotect, run_start, run_end - run_start,
+                    run_prot) == -1) {
+      return -1;
+    }
+    if (region) {
+      run_start = region->start;
+      run_end = region->end;
+      run_prot = prot;
+    }
+  }
+  if (run_syscall(proc, SYS_ioctl, proc->device_fd, KRESTORE_COMMIT, 0) ==
+          -1 ||
+      run_syscall(proc, SYS_close, proc->device_fd, 0, 0) == -1 ||
+      run_syscall(proc, SYS_munmap, proc->scratch, KRESTORE_SCRATCH_SIZE, 0) ==
+          -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// Map the layout into a worker once its handoff is done. The pages are then
+// written straight into the regions: received from the source, or loaded from
+// the image.
+static int map_restored(const handoff_t *handoff, const process_dump_t *dump) {
+  const threads_t *threads = handoff->threads;
+  if (threads->num_threads != dump->num_threads) {
+    fprintf(stderr, "Child has %zu threads instead of %zu\n",
+            threads->num_threads, dump->num_threads);
+    return -1;
+  }
+  return map_regions(handoff->proc, &dump->memory_dump);
+}
+
+// Commit the filled regions and restore the threads, then let the process run
+static int finish_restore(const restoree_t *proc, threads_t *threads,
+                          const process_dump_t *dump, int uffd,
+                          bool step_by_step) {
+  const memory_dump_t *memory_dump = &dump->memory_dump;
+  if (commit_restore(proc, memory_dump) == -1) {
+    return -1;
+  }
+
+  // post-copy: the regions are empty, report their page faults to us
+  if (uffd != -1 && register_lazy_regions(uffd, memory_dump) == -1) {
+    return -1;
+  }
+
+  // restore the general purpose, FPU and vector registers of each thread
+  for (size_t i = 0; i < threads->num_threads; i++) {
+    if (set_cpu_state(threads->tids[i], &dump->cpu_states[i]) == -1) {
+      return -1;
+    }
+  }
+
+  if (step_by_step) {
+    inspect_step_by_step(proc->pid);
+  }
+
+  return detach_process(threads);
+}
+
+// Stack of a thread of the tracee, only used if it runs before its registers
+// are set
+#define PARK_STACK_SIZE (16 * 1024)
+
+// Entry point of the threads of the tracee. They never run it: the tracer
+// keeps them stopped from their creation until it has set their registers.
+static int park_thread(void *arg) {
+  (void)arg;
+  while (1) {
+    pause();
+  }
+  return 0;
+}
+
+// Number of holes of the layout a worker tries to put its scratch area in
+#define MAX_SCRATCH_CANDIDATES 32
+
+// What a claimed worker needs to know of the process it becomes
+typedef struct {
+  uint32_t num_threads;
+  uint32_t lazy; // post-copy: it hands a userfaultfd over
+  uint32_t num_candidates;
+  // addresses for its scratch area in the holes of the layout, tried in order
+  unsigned long candidates[MAX_SCRATCH_CANDIDATES];
+} restore_job_t;
+
+// Upper bound of the size of the pool of workers
+#define MAX_WORKERS 256
+
+// Descriptor of the control socket in a worker
+#define WORKER_CONTROL_FD 3
+
+// A process forked and traced ahead of the migrations, that becomes the
+// restored process once claimed. It waits for its job with the krestore device
+// open and the tracing options set.
+typedef struct {
+  pid_t pid;
+  int control_fd; // its job is sent on it, a userfaultfd comes back
+} worker_t;
+
+typedef struct {
+  worker_t workers[MAX_WORKERS];
+  size_t num_workers;
+  int stdout_fd; // standard output of the restored processes
+} worker_pool_t;
+
+static void plan_job(const process_dump_t *dump, bool lazy,
+                     restore_job_t *job) {
+  const memory_dump_t *memory_dump = &dump->memory_dump;
+  memset(job, 0, sizeof(*job));
+  job->num_threads = dump->num_threads;
+  job->lazy = lazy;
+  for (size_t i = 0; i + 1 < memory_dump->num_regions &&
+                     job->num_candidates < MAX_SCRATCH_CANDIDATES;
+       i++) {
+    unsigned long lo = memory_dump->regions[i].end;
+    unsigned long hi = memory_dump->regions[i + 1].start;
+    if (hi < lo + KRESTORE_SCRATCH_SIZE) {
+      continue;
+    }
+    // away from the ends of the hole, where the heap and stacks grow
+    job->candidates[job->num_candidates++] =
+        (lo + (hi - lo - KRESTORE_SCRATCH_SIZE) / 2) & ~(PAGE_SIZE - 1);
+  }
+}
+
+// Map the scratch area in a hole of the restored layout, it stays mapped until
+// the restore is done
+static char *map_scratch(const restore_job_t *job) {
+  for (uint32_t i = 0; i < job->num_candidates; i++) {
+    char *scratch = mmap((void *)job->candidates[i], KRESTORE_SCRATCH_SIZE,
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                         -1, 0);
+    if (scratch != MAP_FAILED) {
+      return scratch;
+    }
+  }
+  fprintf(stderr, "No room for the scratch area\n");
+  return NULL;
+}
+
+// Body of a worker: get traced, open the device, stop, and once claimed make
+// the ioctl that begins the restore
+static int run_worker(int control_fd, int stdout_fd) {
+  // the restored process keeps the standard output of the restorer, none of
+  // its other descriptors
+  if (dup2(stdout_fd, STDOUT_FILENO) == -1 ||
+      dup2(control_fd, WORKER_CONTROL_FD) == -1) {
+    perror("dup2");
     return EXIT_FAILURE;
   }
-  const char *listen_port = argv[1];
-  while (opt = getopt(argc, argv, "f:s"), opt != -1) {
-    switch (opt) {
-    case 'f':
-      log_filename = optarg;
-      break;
-    case 's':
-      step_by_step = true;
-      break;
-    default:
-      fprintf(stderr, "Usage: %s <listen port> [-f <file path>] [-s]\n",
-              argv[0]);
+  close_range(WORKER_CONTROL_FD + 1, ~0U, 0);
+
+  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+    perror("ptrace(PTRACE_TRACEME)");
+    return EXIT_FAILURE;
+  }
+  // each open file of the device holds its own restore
+  int restorer_fd = open(KRESTORE_DEVICE, O_RDWR);
+  if (restorer_fd == -1) {
+    perror("open restorer_fd");
+    return EXIT_FAILURE;
+  }
+  raise(SIGSTOP);
+
+  restore_job_t job;
+  ssize_t received = recv(WORKER_CONTROL_FD, &job, sizeof(job), MSG_WAITALL);
+  if (received != sizeof(job)) {
+    // the restorer exited without claiming it
+    return EXIT_FAILURE;
+  }
+
+  // post-copy: a userfaultfd is bound to the memory of the process creating
+  // it, hand one over to the tracer which keeps it past the restore
+  if (job.lazy) {
+    int uffd = uffd_create();
+    if (uffd == -1 || send_fd(WORKER_CONTROL_FD, uffd) == -1) {
       return EXIT_FAILURE;
     }
+    close(uffd);
   }
+  close(WORKER_CONTROL_FD);
 
-  if (log_filename) {
-    log_fd = open(log_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (log_fd == -1) {
-      perror("open log file");
+  // the other threads of the process, which share its restored memory
+  for (size_t i = 1; i < job.num_threads; i++) {
+    char *stack = malloc(PARK_STACK_SIZE);
+    if (!stack) {
+      perror("malloc thread stack");
+      return EXIT_FAILURE;
+    }
+    if (clone(park_thread, stack + PARK_STACK_SIZE,
+              CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+                  CLONE_THREAD | CLONE_SYSVSEM,
+              NULL) == -1) {
+      perror("clone");
       return EXIT_FAILURE;
     }
   }
 
-  process_dump_t dump;
-  memset(&dump, 0, sizeof(dump));
+  // The tracer runs the rest of the restore from the scratch area, once the
+  // memory of the process is unmapped
+  char *scratch = map_scratch(&job);
+  if (!scratch) {
+    return EXIT_FAILURE;
+  }
+  memcpy(scratch, syscall_insn, sizeof(syscall_insn));
+
+  // stop for the tracer, which follows the ioctl from there. Nothing is left
+  // in the restored process of the way it was stopped.
+  raise(SIGSTOP);
+  if (ioctl(restorer_fd, KRESTORE_BEGIN, scratch) == -1) {
+    perror("ioctl(KRESTORE_BEGIN)");
+    return EXIT_FAILURE;
+  }
+
+  assert(0); // should not reach here
+}
 
+// Fork a worker and add it to the pool once it waits for its job
+static int start_worker(worker_pool_t *pool) {
+  if (pool->num_workers == MAX_WORKERS) {
+    fprintf(stderr, "Too many workers\n");
+    return -1;
+  }
+  int control_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, control_fds) == -1) {
+    perror("socketpair");
+    return -1;
+  }
+  fflush(stdout); // not to be written again by the worker
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    close(control_fds[0]);
+    close(control_fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    _exit(run_worker(control_fds[1], pool->stdout_fd));
+  }
+  close(control_fds[1]);
+
+  // stopped, it is set up to be traced then let wait for its job. The signals
+  // it gets before are delivered.
+  pending_stop_t stop = {.pid = pid};
+  while (1) {
+    if (waitpid(pid, &stop.status, 0) == -1) {
+      perror("waitpid");
+      goto fail;
+    }
+    if (!WIFSTOPPED(stop.status)) {
+      fprintf(stderr, "Worker %d did not stop\n", pid);
+      goto fail;
+    }
+    if (WSTOPSIG(stop.status) == SIGSTOP) {
+      break;
+    }
+    resume_stop(&stop);
+  }
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             PTRACE_O_TRACECLONE | PTRACE_O_TRACESYSGOOD |
+                 PTRACE_O_EXITKILL) == -1) {
+    perror("ptrace(PTRACE_SETOPTIONS)");
+    goto fail;
+  }
+  if (ptrace(PTRACE_CONT, pid, NULL, NULL) == -1) {
+    perror("ptrace(PTRACE_CONT)");
+    goto fail;
+  }
+  pool->workers[pool->num_workers++] =
+      (worker_t){.pid = pid, .control_fd = control_fds[0]};
+  return 0;
+
+fail:
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(control_fds[0]);
+  return -1;
+}
+
+// Take a worker from the pool, or fork one if it is empty, and send it its
+// job. In post-copy mode, *uffd is the userfaultfd of its memory.
+static int claim_worker(worker_pool_t *pool, const restore_job_t *job,
+                        pid_t *pid, int *uffd) {
+  if (pool->num_workers == 0 && start_worker(pool) == -1) {
+    return -1;
+  }
+  worker_t worker = pool->workers[--pool->num_workers];
+  int ret = 0;
+  if (send(worker.control_fd, job, sizeof(*job), MSG_NOSIGNAL) !=
+      sizeof(*job)) {
+    perror("send job");
+    ret = -1;
+  } else if (job->lazy && (*uffd = recv_fd(worker.control_fd)) == -1) {
+    ret = -1;
+  }
+  close(worker.control_fd);
+  if (ret == -1) {
+    kill(worker.pid, SIGKILL);
+    waitpid(worker.pid, NULL, __WALL);
+    return -1;
+  }
+  *pid = worker.pid;
+  return 0;
+}
+
+static int fill_pool(worker_pool_t *pool, size_t num_workers) {
+  while (pool->num_workers < num_workers) {
+    if (start_worker(pool) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Function to listen on listen_port for the connections of the sources
+static int listen_on(const char *listen_port, int backlog) {
   const char *listen_host = "127.0.0.1";
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
@@ -311,58 +1578,789 @@ int main(int argc, char **argv) {
   int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_fd == -1) {
     perror("socket");
-    return EXIT_FAILURE;
+    return -1;
+  }
+  int reuse = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) == -1) {
+    perror("setsockopt(SO_REUSEADDR)");
+    close(listen_fd);
+    return -1;
   }
   if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
     perror("bind");
-    return EXIT_FAILURE;
+    close(listen_fd);
+    return -1;
   }
-  if (listen(listen_fd, 1) == -1) {
+  if (listen(listen_fd, backlog) == -1) {
     perror("listen");
-    return EXIT_FAILURE;
+    close(listen_fd);
+    return -1;
   }
   printf("Listening on %s:%s\n", listen_host, listen_port);
+  return listen_fd;
+}
 
-  // accept a connection from the client and print everything
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
-  int socket_fd =
-      accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-  if (socket_fd == -1) {
-    perror("accept");
-    return EXIT_FAILURE;
+// Options of the restores
+typedef struct {
+  int num_streams;
+  bool step_by_step;
+  size_t num_workers; // size of the pool kept warm
+} restore_options_t;
+
+static void free_dump(process_dump_t *dump) {
+  memory_dump_t *memory_dump = &dump->memory_dump;
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    free(memory_dump->regions[i].content);
+    free(memory_dump->regions[i].extents);
   }
+  free(memory_dump->regions);
+  free(dump->cpu_states);
+  memset(dump, 0, sizeof(*dump));
+}
 
-  if (recv_dump(&dump, socket_fd) == -1) {
-    printf("Failed to load dump from client\n");
+// Restore the process of the image file source into a worker of the pool
+static int restore_image(const char *source, const restore_options_t *options,
+                         worker_pool_t *pool) {
+  process_dump_t dump;
+  memset(&dump, 0, sizeof(dump));
+  uint64_t load_time = get_time_ns();
+  if (load_image(source, &dump) == -1) {
+    return EXIT_FAILURE;
+  }
+  restore_job_t job;
+  plan_job(&dump, false, &job);
+  pid_t child;
+  if (claim_worker(pool, &job, &child, NULL) == -1) {
+    return EXIT_FAILURE;
+  }
+  threads_t threads;
+  restoree_t proc;
+  handoff_t handoff;
+  if (begin_handoff(&handoff, child, &threads, &proc) == -1 ||
+      run_to_restore(&handoff) == -1 || map_restored(&handoff, &dump) == -1 ||
+      fill_from_image(child, &dump.memory_dump) == -1 ||
+      finish_restore(&proc, &threads, &dump, -1, options->step_by_step) ==
+          -1) {
+    free_threads(&threads);
+    kill(child, SIGKILL);
     return EXIT_FAILURE;
   }
+  printf("Process resumed %lu ns after its memory arrived\n",
+         get_time_ns() - load_time);
+  print_mappings(child);
+  return EXIT_SUCCESS;
+}
 
-  memory_dump_t *memory_dump = &dump.memory_dump;
-  struct user *user_dump = &dump.user_dump;
-  struct user_regs_struct *regs_dump = &user_dump->regs;
+// What an event of the loop is about, the first member of its owner
+enum source_kind {
+  SOURCE_LISTENER,   // a source connects
+  SOURCE_CONNECTION, // the hello of a connection arrives
+  SOURCE_MIGRATION,  // a migration moves on to its next phase
+  SOURCE_CHILDREN,   // a worker or a thread being restored stops or exits
+};
 
-  int child = fork();
-  if (child == -1) {
-    perror("fork");
+typedef struct {
+  enum source_kind kind;
+  int fd;
+} source_t;
+
+// Time a source has to send the hello of a connection, or to connect all the
+// streams of a migration, before they are dropped
+#define CONNECT_TIMEOUT_NS (10 * 1000000000UL)
+
+// A connection waiting for the hello of its next migration. The hello is
+// received as it arrives, the loop never waits for the rest of it.
+typedef struct connection {
+  source_t source;
+  wire_hello_t hello;
+  size_t received;
+  uint64_t deadline_ns; // 0 for a kept connection until its hello begins
+  struct connection *next;
+} connection_t;
+
+enum migration_phase {
+  PHASE_CONNECTING, // waiting for the connections of its streams
+  PHASE_RECEIVING,  // pre-copy rounds, until the layout arrives
+  PHASE_STARTING,   // the claimed worker runs to the ioctl that begins it
+  PHASE_FILLING,    // the last round is written into the mapped process
+  PHASE_FAULTING,   // post-copy, the running process faults in its pages
+};
+
+// A migration being restored. Its blocking work runs in threads, the stream
+// threads and the post-copy fault handler, that signal its eventfd. The loop
+// runs its steps in between: the handoff of a worker, driven by the stops of
+// its threads, the mapping of the layout and the commit.
+typedef struct migration {
+  source_t source; // its eventfd
+  uint64_t id;
+  int mode;
+  enum migration_phase phase;
+  int num_streams;
+  int num_connected;
+  int socket_fds[MAX_STREAMS];
+  uint64_t deadline_ns; // to connect all of its streams
+  process_dump_t dump;
+  recv_state_t receiver;
+  bool receiving; // its stream threads are not joined yet
+  pid_t child;
+  threads_t threads;
+  restoree_t proc;
+  handoff_t handoff;
+  int uffd;
+  pthread_t fault_thread;
+  bool faults_done;
+  int faults_ret;
+  struct migration *next;
+} migration_t;
+
+// The restore daemon: the migrations in progress and the workers for the next
+// ones
+typedef struct {
+  int epoll_fd;
+  source_t listener;
+  source_t children; // signalfd of SIGCHLD
+  pending_stops_t pending; // stops of threads not announced yet
+  connection_t *connections;
+  migration_t *migrations;
+  worker_pool_t *pool;
+  const restore_options_t *options;
+  size_t num_restored;
+  size_t num_failed;
+} restorer_t;
+
+static int watch(restorer_t *restorer, source_t *source) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = source};
+  if (epoll_ctl(restorer->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+// Watch a connection for the hello of the next migration on it, closed on
+// failure. A connection kept from a migration waits for the next one as long
+// as the source keeps it.
+static int watch_connection(restorer_t *restorer, int fd, bool kept) {
+  connection_t *connection = calloc(1, sizeof(*connection));
+  if (!connection) {
+    perror("calloc connection");
+    close(fd);
+    return -1;
+  }
+  connection->source.kind = SOURCE_CONNECTION;
+  connection->source.fd = fd;
+  if (!kept) {
+    connection->deadline_ns = get_time_ns() + CONNECT_TIMEOUT_NS;
+  }
+  if (watch(restorer, &connection->source) == -1) {
+    free(connection);
+    close(fd);
+    return -1;
+  }
+  connection->next = restorer->connections;
+  restorer->connections = connection;
+  return 0;
+}
+
+// Stop watching a connection and free it, its descriptor is left open
+static void forget_connection(restorer_t *restorer, connection_t *connection) {
+  epoll_ctl(restorer->epoll_fd, EPOLL_CTL_DEL, connection->source.fd, NULL);
+  connection_t **link = &restorer->connections;
+  while (*link != connection) {
+    link = &(*link)->next;
+  }
+  *link = connection->next;
+  free(connection);
+}
+
+static migration_t *new_migration(restorer_t *restorer, uint64_t id, int mode,
+                                  int num_streams) {
+  migration_t *migration = calloc(1, sizeof(*migration));
+  if (!migration) {
+    perror("calloc migration");
+    return NULL;
+  }
+  migration->source.kind = SOURCE_MIGRATION;
+  migration->source.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (migration->source.fd == -1) {
+    perror("eventfd");
+    free(migration);
+    return NULL;
+  }
+  migration->id = id;
+  migration->mode = mode;
+  migration->num_streams = num_streams;
+  migration->deadline_ns = get_time_ns() + CONNECT_TIMEOUT_NS;
+  migration->child = -1;
+  migration->uffd = -1;
+  for (int i = 0; i < MAX_STREAMS; i++) {
+    migration->socket_fds[i] = -1;
+  }
+  if (watch(restorer, &migration->source) == -1) {
+    close(migration->source.fd);
+    free(migration);
+    return NULL;
+  }
+  migration->next = restorer->migrations;
+  restorer->migrations = migration;
+  return migration;
+}
+
+// End a migration, done or failed, and free it
+static void end_migration(restorer_t *restorer, migration_t *migration,
+                          bool failed) {
+  if (failed) {
+    fprintf(stderr, "Migration %lx failed\n", migration->id);
+    restorer->num_failed++;
+    if (migration->receiving) {
+      fail_streams(&migration->receiver);
+      join_streams(&migration->receiver);
+    }
+    // A post-copy process must not run without its memory: once the
+    // userfaultfd is closed, the pages not fetched yet would read as zeros.
+    // An eager one resumed with all of it and keeps running.
+    bool complete =
+        migration->phase == PHASE_FAULTING && migration->uffd == -1;
+    if (migration->child != -1 && !complete) {
+      kill(migration->child, SIGKILL);
+    }
+    if (migration->child != -1 && migration->phase != PHASE_FAULTING) {
+      free_threads(&migration->threads);
+    }
+  } else {
+    restorer->num_restored++;
+  }
+  if (migration->uffd != -1) {
+    close(migration->uffd);
+  }
+  // the source sends its next migration over the connections of an eager
+  // one, they carry nothing more once the process resumed
+  bool keep = !failed && migration->mode == MIGRATION_EAGER;
+  for (int i = 0; i < migration->num_streams; i++) {
+    if (migration->socket_fds[i] == -1) {
+      continue;
+    }
+    if (keep) {
+      watch_connection(restorer, migration->socket_fds[i], true);
+    } else {
+      close(migration->socket_fds[i]);
+    }
+  }
+  free_dump(&migration->dump);
+  close(migration->source.fd); // also leaves the epoll set
+  migration_t **link = &restorer->migrations;
+  while (*link != migration) {
+    link = &(*link)->next;
+  }
+  *link = migration->next;
+  free(migration);
+}
+
+static void *handle_faults(void *arg) {
+  migration_t *migration = arg;
+  int ret = handle_page_faults(migration->uffd, migration->socket_fds[0]);
+  // on failure pages are still missing, the regions stay registered until
+  // the process is killed
+  if (ret == 0) {
+    unregister_lazy_regions(migration->uffd, &migration->dump.memory_dump);
+  }
+  migration->faults_ret = ret;
+  __atomic_store_n(&migration->faults_done, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(migration->source.fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("write event");
+  }
+  return NULL;
+}
+
+// The layout has arrived, received by the thread of stream 0: a worker is
+// claimed to become the process, its stops move the handoff on. This runs in
+// the loop, the thread that traces the workers, and waits for nothing.
+static int on_layout(restorer_t *restorer, migration_t *migration) {
+  // The regions are mapped empty, the pages are written into them once the
+  // process exists. In post-copy mode they are filled on demand.
+  const memory_dump_t *memory_dump = &migration->dump.memory_dump;
+  for (size_t i = 0; i < memory_dump->num_regions; i++) {
+    const memory_region_t *region = &memory_dump->regions[i];
+    printf("Recv Region %zu: %lx-%lx (%s) %s (offset=%lx), size: %zu%s\n", i,
+           region->start, region->end, region->permissions, region->path,
+           region->offset, region->size,
+           region->huge_pages ? ", huge pages" : "");
+  }
+  restore_job_t job;
+  bool lazy = migration->mode == MIGRATION_POSTCOPY;
+  plan_job(&migration->dump, lazy, &job);
+  if (claim_worker(restorer->pool, &job, &migration->child,
+                   &migration->uffd) == -1) {
+    return -1;
+  }
+  if (begin_handoff(&migration->handoff, migration->child,
+                    &migration->threads, &migration->proc) == -1) {
+    return -1;
+  }
+  migration->phase = PHASE_STARTING;
+  return 0;
+}
+
+// The ioctl that begins the restore returned: the regions are mapped, then the
+// streams write the staged pages and the last round into them
+static int on_started(migration_t *migration) {
+  if (map_restored(&migration->handoff, &migration->dump) == -1) {
+    return -1;
+  }
+  migration->phase = PHASE_FILLING;
+  start_filling(&migration->receiver, migration->child);
+  return 0;
+}
+
+// The last round is in the process: let it run
+static int on_filled(restorer_t *restorer, migration_t *migration) {
+  migration->receiving = false;
+  if (join_streams(&migration->receiver) == -1) {
+    return -1;
+  }
+  if (migration->receiver.num_dropped > 0) {
+    printf("%zu staged pages dropped, no longer in the layout\n",
+           migration->receiver.num_dropped);
+  }
+  if (finish_restore(&migration->proc, &migration->threads, &migration->dump,
+                     migration->uffd, restorer->options->step_by_step) == -1) {
+    return -1;
+  }
+  // the threads are detached, the process is no longer killed on failure
+  migration->phase = PHASE_FAULTING;
+
+  // the source waits for this to kill its copy and account the downtime
+  uint64_t restore_ns = get_time_ns() - migration->receiver.received_ns;
+  printf("Process resumed %lu ns after its memory arrived\n", restore_ns);
+  if (send_resumed(migration->socket_fds[0], restore_ns) == -1) {
+    return -1;
+  }
+  print_mappings(migration->child);
+
+  // the process is running, fetch its memory while it faults on it
+  if (migration->uffd == -1) {
+    end_migration(restorer, migration, false);
+    return 0;
+  }
+  if (pthread_create(&migration->fault_thread, NULL, handle_faults,
+                     migration) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+static void on_migration(restorer_t *restorer, migration_t *migration) {
+  uint64_t count;
+  if (read(migration->source.fd, &count, sizeof(count)) == -1 &&
+      errno != EAGAIN) {
+    perror("read event");
+  }
+  if (migration->phase == PHASE_FAULTING) {
+    if (__atomic_load_n(&migration->faults_done, __ATOMIC_ACQUIRE)) {
+      pthread_join(migration->fault_thread, NULL);
+      end_migration(restorer, migration, migration->faults_ret == -1);
+    }
+    return;
+  }
+
+  recv_state_t *receiver = &migration->receiver;
+  pthread_mutex_lock(&receiver->lock);
+  bool failed = receiver->failed;
+  bool at_layout = receiver->at_layout == migration->num_streams;
+  bool done = receiver->num_done == migration->num_streams;
+  pthread_mutex_unlock(&receiver->lock);
+  int ret = 0;
+  if (failed) {
+    ret = -1;
+  } else if (migration->phase == PHASE_RECEIVING && at_layout) {
+    ret = on_layout(restorer, migration);
+  } else if (migration->phase == PHASE_FILLING && done) {
+    ret = on_filled(restorer, migration);
+  }
+  if (ret == -1) {
+    end_migration(restorer, migration, true);
+  }
+}
+
+static bool is_idle_worker(const worker_pool_t *pool, pid_t pid) {
+  for (size_t i = 0; i < pool->num_workers; i++) {
+    if (pool->workers[i].pid == pid) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The children changed state: the threads of the handoffs stop, the workers
+// waiting for their job stop for signals, and the processes restored before
+// exit. The stops of a tracee are reported to the tracer even without
+// WUNTRACED, none is left waiting.
+static void on_children(restorer_t *restorer) {
+  struct signalfd_siginfo info;
+  while (read(restorer->children.fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+  pending_stop_t stop;
+  while ((stop.pid = waitpid(-1, &stop.status, WNOHANG | __WALL)) > 0) {
+    migration_t *migration = restorer->migrations;
+    while (migration && !(migration->phase == PHASE_STARTING &&
+                          in_handoff(&migration->handoff, stop.pid))) {
+      migration = migration->next;
+    }
+    if (migration) {
+      int ret = on_handoff_stop(&migration->handoff, stop.pid, stop.status,
+                                &restorer->pending);
+      if (ret == -1 || (ret == 1 && on_started(migration) == -1)) {
+        end_migration(restorer, migration, true);
+      }
+      continue;
+    }
+    if (!WIFSTOPPED(stop.status)) {
+      continue;
+    }
+    // a new thread of a handoff may stop before its clone event
+    if (is_idle_worker(restorer->pool, stop.pid) ||
+        add_pending_stop(&restorer->pending, stop.pid, stop.status) == -1) {
+      resume_stop(&stop);
+    }
+  }
+
+  // the stops no handoff claimed belong to none
+  migration_t *migration = restorer->migrations;
+  while (migration && migration->phase != PHASE_STARTING) {
+    migration = migration->next;
+  }
+  if (!migration) {
+    resume_pending_stops(&restorer->pending);
+  }
+}
+
+// The hello of a connection tells which migration it belongs to, the
+// migration starts once all of its streams are connected
+static void on_connection(restorer_t *restorer, connection_t *connection) {
+  int fd = connection->source.fd;
+  char *hello = (char *)&connection->hello;
+  ssize_t ret = recv(fd, hello + connection->received,
+                     sizeof(connection->hello) - connection->received,
+                     MSG_DONTWAIT);
+  if (ret == -1 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (ret <= 0) {
+    // the source closes the connections it kept once it is done
+    if (ret == -1) {
+      perror("recv hello");
+    } else if (connection->received > 0) {
+      fprintf(stderr, "Connection closed in the middle of its hello\n");
+    }
+    forget_connection(restorer, connection);
+    close(fd);
+    return;
+  }
+  if (connection->received == 0 && connection->deadline_ns == 0) {
+    connection->deadline_ns = get_time_ns() + CONNECT_TIMEOUT_NS;
+  }
+  connection->received += ret;
+  if (connection->received < sizeof(connection->hello)) {
+    return;
+  }
+  uint64_t id;
+  int mode, num_streams, stream;
+  ret = check_hello(&connection->hello, &id, &mode, &num_streams, &stream);
+  forget_connection(restorer, connection);
+  if (ret == -1) {
+    close(fd);
+    return;
+  }
+  if (num_streams != restorer->options->num_streams) {
+    fprintf(stderr, "The checkpoint uses %d streams, restore expects %d\n",
+            num_streams, restorer->options->num_streams);
+    close(fd);
+    return;
+  }
+  if (mode == MIGRATION_POSTCOPY && restorer->options->step_by_step) {
+    fprintf(stderr, "Step-by-step inspection is not supported in post-copy "
+                    "mode\n");
+    close(fd);
+    return;
+  }
+
+  migration_t *migration = restorer->migrations;
+  while (migration && migration->id != id) {
+    migration = migration->next;
+  }
+  if (!migration &&
+      !(migration = new_migration(restorer, id, mode, num_streams))) {
+    close(fd);
+    return;
+  }
+  if (migration->phase != PHASE_CONNECTING || stream >= num_streams ||
+      migration->socket_fds[stream] != -1 || mode != migration->mode) {
+    fprintf(stderr, "Unexpected stream %d of migration %lx\n", stream, id);
+    close(fd);
+    return;
+  }
+  migration->socket_fds[stream] = fd;
+  if (++migration->num_connected < num_streams) {
+    return;
+  }
+  migration->phase = PHASE_RECEIVING;
+  migration->receiving = true;
+  if (start_streams(&migration->receiver, migration->socket_fds, num_streams,
+                    &migration->dump, migration->source.fd) == -1) {
+    end_migration(restorer, migration, true);
+  }
+}
+
+static void on_listener(restorer_t *restorer) {
+  while (1) {
+    int fd = accept(restorer->listener.fd, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
+      return;
+    }
+    watch_connection(restorer, fd, false);
+  }
+}
+
+// Drop the connections whose hello did not arrive in time, and the migrations
+// whose streams did not all connect. Returns the time until the next of those
+// deadlines in milliseconds, -1 if there is none.
+static int drop_stalled(restorer_t *restorer) {
+  uint64_t now = get_time_ns();
+  uint64_t next = 0;
+  for (connection_t *connection = restorer->connections, *following;
+       connection; connection = following) {
+    following = connection->next;
+    if (connection->deadline_ns == 0) {
+      continue;
+    }
+    if (connection->deadline_ns <= now) {
+      fprintf(stderr, "No hello on connection %d, dropped\n",
+              connection->source.fd);
+      int fd = connection->source.fd;
+      forget_connection(restorer, connection);
+      close(fd);
+    } else if (next == 0 || connection->deadline_ns < next) {
+      next = connection->deadline_ns;
+    }
+  }
+  for (migration_t *migration = restorer->migrations, *following; migration;
+       migration = following) {
+    following = migration->next;
+    if (migration->phase != PHASE_CONNECTING) {
+      continue;
+    }
+    if (migration->deadline_ns <= now) {
+      fprintf(stderr, "Migration %lx connected %d of its %d streams\n",
+              migration->id, migration->num_connected,
+              migration->num_streams);
+      end_migration(restorer, migration, true);
+    } else if (next == 0 || migration->deadline_ns < next) {
+      next = migration->deadline_ns;
+    }
+  }
+  if (next == 0) {
+    return -1;
+  }
+  // rounded up, not to wake up just before the deadline
+  return (next - now + 999999) / 1000000;
+}
+
+// Number of events handled at once by the loop
+#define MAX_EVENTS 64
+
+// Restore the migrations arriving on listen_fd, concurrently, until
+// interrupted. With serve unset, return once the first one is done.
+static int run_restorer(int listen_fd, bool serve,
+                        const restore_options_t *options,
+                        worker_pool_t *pool) {
+  restorer_t restorer;
+  memset(&restorer, 0, sizeof(restorer));
+  restorer.pool = pool;
+  restorer.options = options;
+  restorer.listener.kind = SOURCE_LISTENER;
+  restorer.listener.fd = listen_fd;
+  restorer.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (restorer.epoll_fd == -1) {
+    perror("epoll_create1");
+    return EXIT_FAILURE;
+  }
+  int flags = fcntl(listen_fd, F_GETFL);
+  if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
     return EXIT_FAILURE;
   }
-  if (child == 0) {
-    int ret = tracee(memory_dump);
-    if (ret == EXIT_FAILURE) {
+  if (watch(&restorer, &restorer.listener) == -1) {
+    return EXIT_FAILURE;
+  }
+  // the threads of the loop, and the workers forked by it, leave SIGCHLD to
+  // the signalfd; the restored processes get their own signal mask back
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &sigchld, NULL) == -1) {
+    perror("sigprocmask");
+    return EXIT_FAILURE;
+  }
+  restorer.children.kind = SOURCE_CHILDREN;
+  restorer.children.fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (restorer.children.fd == -1) {
+    perror("signalfd");
+    return EXIT_FAILURE;
+  }
+  if (watch(&restorer, &restorer.children) == -1) {
+    return EXIT_FAILURE;
+  }
+  // children may have changed state before
+  on_children(&restorer);
+
+  int timeout_ms = -1; // until the next connection or migration stalls
+  while (serve || restorer.num_restored + restorer.num_failed == 0) {
+    // the workers claimed are replaced while no event waits
+    if (pool->num_workers < options->num_workers) {
+      struct epoll_event event;
+      int ready = epoll_wait(restorer.epoll_fd, &event, 1, 0);
+      if (ready == 0 && start_worker(pool) == -1) {
+        return EXIT_FAILURE;
+      }
+    }
+    struct epoll_event events[MAX_EVENTS];
+    int num_events =
+        epoll_wait(restorer.epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
       return EXIT_FAILURE;
     }
-  } else {
-    // make log_fd the standard output
-    if (log_fd != -1) {
-      dup2(log_fd, STDOUT_FILENO);
+    bool children = false;
+    for (int i = 0; i < num_events; i++) {
+      source_t *source = events[i].data.ptr;
+      switch (source->kind) {
+      case SOURCE_LISTENER:
+        on_listener(&restorer);
+        break;
+      case SOURCE_CONNECTION:
+        on_connection(&restorer, (connection_t *)source);
+        break;
+      case SOURCE_MIGRATION:
+        on_migration(&restorer, (migration_t *)source);
+        break;
+      case SOURCE_CHILDREN:
+        children = true;
+        break;
+      }
+    }
+    // once the events are handled, it may end any migration
+    if (children) {
+      on_children(&restorer);
     }
+    timeout_ms = drop_stalled(&restorer);
+  }
+  resume_pending_stops(&restorer.pending);
+  free(restorer.pending.stops);
+  close(restorer.children.fd);
+  close(restorer.epoll_fd);
+  return restorer.num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    int ret = tracer(child, step_by_step, regs_dump);
-    if (ret == EXIT_FAILURE) {
+int main(int argc, char **argv) {
+  // Usage: ./restore <listen port | image file> [-f <file path>] [-s]
+  //                  [-j <streams>] [-w <workers>]
+  int opt;
+  char *log_filename = NULL;
+  int log_fd = -1;
+  restore_options_t options = {
+      .num_streams = DEFAULT_STREAMS,
+      .step_by_step = false,
+      .num_workers = 0,
+  };
+  int num_workers = 0;
+  if (argc < 2) {
+    fprintf(stderr,
+            "Usage: %s <listen port | image file> [-f <file path>] [-s] "
+            "[-j <streams>] [-w <workers>]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  // a listen port is all digits, anything else is an image file
+  const char *source = argv[1];
+  bool from_image = source[strspn(source, "0123456789")] != '\0';
+  while (opt = getopt(argc, argv, "f:sj:w:"), opt != -1) {
+    switch (opt) {
+    case 'f':
+      log_filename = optarg;
+      break;
+    case 's':
+      options.step_by_step = true;
+      break;
+    case 'j':
+      options.num_streams = atoi(optarg);
+      break;
+    case 'w':
+      num_workers = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s <listen port | image file> [-f <file path>] [-s] "
+              "[-j <streams>] [-w <workers>]\n",
+              argv[0]);
       return EXIT_FAILURE;
     }
   }
+  if (options.num_streams < 1 || options.num_streams > MAX_STREAMS) {
+    fprintf(stderr, "The number of streams must be between 1 and %d\n",
+            MAX_STREAMS);
+    return EXIT_FAILURE;
+  }
+  if (num_workers < 0 || num_workers > MAX_WORKERS) {
+    fprintf(stderr, "The number of workers must be between 0 and %d\n",
+            MAX_WORKERS);
+    return EXIT_FAILURE;
+  }
+  // with a pool of workers, migrations are restored until interrupted
+  bool serve = num_workers > 0 && !from_image;
+  options.num_workers = num_workers;
 
-  return EXIT_SUCCESS;
-}
\ No newline at end of file
+  if (log_filename) {
+    log_fd = open(log_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd == -1) {
+      perror("open log file");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The restored processes are forked ahead of the migrations, one if none
+  // is kept warm
+  worker_pool_t pool;
+  pool.num_workers = 0;
+  pool.stdout_fd = dup(STDOUT_FILENO);
+  if (pool.stdout_fd == -1) {
+    perror("dup");
+    return EXIT_FAILURE;
+  }
+  if (fill_pool(&pool, num_workers > 0 ? num_workers : 1) == -1) {
+    return EXIT_FAILURE;
+  }
+
+  // make log_fd the standard output
+  if (log_fd != -1) {
+    dup2(log_fd, STDOUT_FILENO);
+  }
+
+  if (from_image) {
+    return restore_image(source, &options, &pool);
+  }
+  int listen_fd = listen_on(source, serve ? SOMAXCONN : options.num_streams);
+  if (listen_fd == -1) {
+    return EXIT_FAILURE;
+  }
+  return run_restorer(listen_fd, serve, &options, &pool);
+}
@@ -0,0 +1,351 @@
+#include "stream.h"
+#include "capture.h"
+#include "wire.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PIECES (STREAM_CHUNK_SIZE / PAGE_SIZE)
+
+typedef struct {
+  char *buf;
+  size_t count; // number of pieces
+  size_t used;  // bytes of buf in use
+  struct iovec local[MAX_PIECES];
+  struct iovec remote[MAX_PIECES];
+} stream_chunk_t;
+
+// FIFO of slot indexes
+typedef struct {
+  size_t *slots;
+  size_t head;
+  size_t count;
+} slot_queue_t;
+
+typedef struct {
+  pid_t pid;
+  const page_runs_t *runs;
+  stream_chunk_t *slots;
+  size_t num_slots;
+  slot_queue_t free_slots;
+  slot_queue_t filled_slots;
+  bool done; // the reader filled its last chunk
+  bool failed;
+  size_t sent_bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} stream_ring_t;
+
+typedef struct {
+  stream_ring_t *ring;
+  int socket_fd;
+  int compress_level;
+  page_cache_t *cache;
+  bool last_round;
+} stream_sender_t;
+
+int buffer_pool_init(buffer_pool_t *pool, size_t budget) {
+  memset(pool, 0, sizeof(*pool));
+  pool->max_buffers = budget / STREAM_CHUNK_SIZE;
+  pool->free_bufs = calloc(pool->max_buffers, sizeof(*pool->free_bufs));
+  if (pool->max_buffers > 0 && !pool->free_bufs) {
+    perror("calloc buffer pool");
+    return -1;
+  }
+  return 0;
+}
+
+char *buffer_pool_get(buffer_pool_t *pool) {
+  if (pool->num_free > 0) {
+    return pool->free_bufs[--pool->num_free];
+  }
+  if (pool->num_allocated >= pool->max_buffers) {
+    fprintf(stderr, "Chunk buffers exhausted\n");
+    return NULL;
+  }
+  char *buf = aligned_alloc(PAGE_SIZE, STREAM_CHUNK_SIZE);
+  if (!buf) {
+    perror("aligned_alloc chunk buffer");
+    return NULL;
+  }
+  pool->num_allocated++;
+  return buf;
+}
+
+void buffer_pool_put(buffer_pool_t *pool, char *buf) {
+  pool->free_bufs[pool->num_free++] = buf;
+}
+
+void buffer_pool_free(buffer_pool_t *pool) {
+  for (size_t i = 0; i < pool->num_free; i++) {
+    free(pool->free_bufs[i]);
+  }
+  free(pool->free_bufs);
+  memset(pool, 0, sizeof(*pool));
+}
+
+size_t stream_min_buffers(int num_streams, int compress_level) {
+  return compress_level > 0 ? 2 * num_streams : num_streams;
+}
+
+static void push_slot(slot_queue_t *queue, size_t num_slots, size_t slot) {
+  queue->slots[(queue->head + queue->count) % num_slots] = slot;
+  queue->count++;
+}
+
+static size_t pop_slot(slot_queue_t *queue, size_t num_slots) {
+  size_t slot = queue->slots[queue->head];
+  queue->head = (queue->head + 1) % num_slots;
+  queue->count--;
+  return slot;
+}
+
+// Fills chunk with the next pages of the runs, starting at (*i, *addr)
+static void fill_chunk(stream_chunk_t *chunk, const page_runs_t *runs,
+                       size_t *i, unsigned long *addr) {
+  chunk->count = 0;
+  chunk->used = 0;
+  while (*i < runs->num_runs && chunk->used < STREAM_CHUNK_SIZE) {
+    // A piece stays within a huge page frame, and the pieces of a frame are
+    // not split over two chunks: a huge page is moved as a unit.
+    size_t size = runs->runs[*i].end - *addr;
+    size_t frame_left = HUGE_PAGE_SIZE - (*addr & (HUGE_PAGE_SIZE - 1));
+    if (size > frame_left) {
+      size = frame_left;
+    }
+    if (size > STREAM_CHUNK_SIZE - chunk->used) {
+      break;
+    }
+    chunk->local[chunk->count].iov_base = chunk->buf + chunk->used;
+    chunk->local[chunk->count].iov_len = size;
+    chunk->remote[chunk->count].iov_base = (void *)*addr;
+    chunk->remote[chunk->count].iov_len = size;
+    chunk->count++;
+    chunk->used += size;
+    *addr += size;
+    if (*addr == runs->runs[*i].end && ++*i < runs->num_runs) {
+      *addr = runs->runs[*i].start;
+    }
+  }
+}
+
+static void *read_chunks(void *arg) {
+  stream_ring_t *ring = arg;
+  capture_t capture;
+  if (capture_open(&capture, ring->pid) == -1) {
+    pthread_mutex_lock(&ring->lock);
+    ring->failed = true;
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+  }
+
+  size_t i = 0;
+  unsigned long addr = ring->runs->num_runs > 0 ? ring->runs->runs[0].start : 0;
+  while (i < ring->runs->num_runs) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->free_slots.count == 0 && !ring->failed) {
+      pthread_cond_wait(&ring->not_full, &ring->lock);
+    }
+    if (ring->failed) {
+      pthread_mutex_unlock(&ring->lock);
+      break;
+    }
+    size_t slot = pop_slot(&ring->free_slots, ring->num_slots);
+    pthread_mutex_unlock(&ring->lock);
+
+    // read outside of the lock, the senders work on other slots meanwhile
+    stream_chunk_t *chunk = &ring->slots[slot];
+    fill_chunk(chunk, ring->runs, &i, &addr);
+    int ret = capture_read(&capture, chunk->local, chunk->remote, chunk->count);
+
+    pthread_mutex_lock(&ring->lock);
+    if (ret == -1) {
+      ring->failed = true;
+      pthread_cond_broadcast(&ring->not_empty);
+      pthread_mutex_unlock(&ring->lock);
+      break;
+    }
+    push_slot(&ring->filled_slots, ring->num_slots, slot);
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  ring->done = true;
+  pthread_cond_broadcast(&ring->not_empty);
+  pthread_mutex_unlock(&ring->lock);
+  capture_close(&capture);
+  return NULL;
+}
+
+static void *send_chunks(void *arg) {
+  stream_sender_t *sender = arg;
+  stream_ring_t *ring = sender->ring;
+  compressor_t compressor;
+  long ret = compressor_init(&compressor, sender->compress_level,
+                             STREAM_CHUNK_SIZE);
+  if (ret == -1) {
+    pthread_mutex_lock(&ring->lock);
+    ring->failed = true;
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+    return (void *)ret;
+  }
+  page_encoder_t encoder = {.compressor = &compressor, .cache = sender->cache};
+
+  while (1) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->filled_slots.count == 0 && !ring->done && !ring->failed) {
+      pthread_cond_wait(&ring->not_empty, &ring->lock);
+    }
+    if (ring->failed || ring->filled_slots.count == 0) {
+      // failure, or the reader is done and every chunk was taken
+      ret = ring->failed ? -1 : 0;
+      pthread_mutex_unlock(&ring->lock);
+      break;
+    }
+    size_t slot = pop_slot(&ring->filled_slots, ring->num_slots);
+    pthread_mutex_unlock(&ring->lock);
+
+    stream_chunk_t *chunk = &ring->slots[slot];
+    for (size_t j = 0; j < chunk->count && ret == 0; j++) {
+      ret = send_pages(sender->socket_fd,
+                       (unsigned long)chunk->remote[j].iov_base,
+                       chunk->local[j].iov_base, chunk->local[j].iov_len,
+                       &encoder);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    if (ret == -1) {
+      ring->failed = true;
+      pthread_cond_broadcast(&ring->not_empty);
+    } else {
+      ring->sent_bytes += chunk->used;
+    }
+    push_slot(&ring->free_slots, ring->num_slots, slot);
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->lock);
+    if (ret == -1) {
+      break;
+    }
+  }
+
+  // every stream ends the round, once all of its records are sent
+  if (ret == 0 && send_round_end(sender->socket_fd, sender->last_round) == -1) {
+    ret = -1;
+  }
+  compressor_free(&compressor);
+  return (void *)ret;
+}
+
+int stream_pages(pid_t pid, const page_runs_t *runs, const streams_t *streams,
+                 bool last_round, size_t *sent_bytes) {
+  int num_streams = streams->num_streams;
+  stream_ring_t ring;
+  memset(&ring, 0, sizeof(ring));
+  ring.pid = pid;
+  ring.runs = runs;
+  // The budget left by the compression buffers reads ahead, up to the size
+  // of the round
+  buffer_pool_t *pool = streams->pool;
+  size_t compress_buffers = streams->compress_level > 0 ? num_streams : 0;
+  size_t round_chunks =
+      (runs->num_pages * PAGE_SIZE + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+  ring.num_slots = pool->max_buffers > compress_buffers
+                       ? pool->max_buffers - compress_buffers
+                       : 1;
+  if (ring.num_slots > round_chunks && round_chunks > 0) {
+    ring.num_slots = round_chunks;
+  }
+
+  int ret = 0;
+  stream_sender_t *senders = calloc(num_streams, sizeof(*senders));
+  pthread_t *threads = calloc(num_streams, sizeof(*threads));
+  ring.slots = calloc(ring.num_slots, sizeof(*ring.slots));
+  ring.free_slots.slots = calloc(ring.num_slots, sizeof(size_t));
+  ring.filled_slots.slots = calloc(ring.num_slots, sizeof(size_t));
+  if (!senders || !threads || !ring.slots || !ring.free_slots.slots ||
+      !ring.filled_slots.slots) {
+    perror("calloc stream ring");
+    ret = -1;
+    goto free;
+  }
+  for (size_t i = 0; i < ring.num_slots; i++) {
+    ring.slots[i].buf = buffer_pool_get(pool);
+    if (!ring.slots[i].buf) {
+      ret = -1;
+      goto free;
+    }
+    push_slot(&ring.free_slots, ring.num_slots, i);
+  }
+  pthread_mutex_init(&ring.lock, NULL);
+  pthread_cond_init(&ring.not_empty, NULL);
+  pthread_cond_init(&ring.not_full, NULL);
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, read_chunks, &ring) != 0) {
+    perror("pthread_create");
+    ret = -1;
+    goto destroy;
+  }
+  int num_started = 0;
+  for (; num_started < num_streams; num_started++) {
+    senders[num_started].ring = &ring;
+    senders[num_started].socket_fd = streams->socket_fds[num_started];
+    senders[num_started].compress_level = streams->compress_level;
+    senders[num_started].cache = streams->cache;
+    senders[num_started].last_round = last_round;
+    if (pthread_create(&threads[num_started], NULL, send_chunks,
+                       &senders[num_started]) != 0) {
+      perror("pthread_create");
+      pthread_mutex_lock(&ring.lock);
+      ring.failed = true;
+      pthread_cond_broadcast(&ring.not_empty);
+      pthread_cond_broadcast(&ring.not_full);
+      pthread_mutex_unlock(&ring.lock);
+      ret = -1;
+      break;
+    }
+  }
+  for (int i = 0; i < num_started; i++) {
+    void *send_ret;
+    pthread_join(threads[i], &send_ret);
+    if (send_ret != NULL) {
+      ret = -1;
+    }
+  }
+  // the senders may have failed while the reader waits for a free slot
+  pthread_mutex_lock(&ring.lock);
+  if (ret == -1) {
+    ring.failed = true;
+  }
+  pthread_cond_broadcast(&ring.not_full);
+  pthread_mutex_unlock(&ring.lock);
+  pthread_join(reader, NULL);
+  if (ring.failed) {
+    ret = -1;
+  }
+  *sent_bytes += ring.sent_bytes;
+
+destroy:
+  pthread_cond_destroy(&ring.not_full);
+  pthread_cond_destroy(&ring.not_empty);
+  pthread_mutex_destroy(&ring.lock);
+free:
+  if (ring.slots) {
+    for (size_t i = 0; i < ring.num_slots && ring.slots[i].buf; i++) {
+      buffer_pool_put(pool, ring.slots[i].buf);
+    }
+  }
+  free(ring.filled_slots.slots);
+  free(ring.free_slots.slots);
+  free(ring.slots);
+  free(threads);
+  free(senders);
+  return ret;
+}
@@ -0,0 +1,263 @@
+#include "vma.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of the reads of /proc/<pid>/maps when it is parsed
+#define MAPS_READ_SIZE (64 * 1024)
+
+static int init_table(vma_table_t *table) {
+  memset(table, 0, sizeof(*table));
+  // reserved once, the pages are populated as the arenas fill up
+  table->vmas = mmap(NULL, VMA_TABLE_MAX_VMAS * sizeof(vma_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  table->strings =
+      mmap(NULL, VMA_TABLE_MAX_STRINGS, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  table->num_slots = 256;
+  table->slots = calloc(table->num_slots, sizeof(*table->slots));
+  if (table->vmas == MAP_FAILED || table->strings == MAP_FAILED ||
+      !table->slots) {
+    perror("mmap vma table");
+    if (table->vmas == MAP_FAILED) {
+      table->vmas = NULL;
+    }
+    if (table->strings == MAP_FAILED) {
+      table->strings = NULL;
+    }
+    free_vmas(table);
+    return -1;
+  }
+  table->strings[0] = '\0'; // the empty path
+  table->strings_size = 1;
+  return 0;
+}
+
+static uint32_t hash_path(const char *path, size_t len) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int grow_slots(vma_table_t *table) {
+  size_t num_slots = table->num_slots * 2;
+  uint32_t *slots = calloc(num_slots, sizeof(*slots));
+  if (!slots) {
+    perror("calloc path slots");
+    return -1;
+  }
+  for (size_t i = 0; i < table->num_slots; i++) {
+    uint32_t offset = table->slots[i];
+    if (offset == 0) {
+      continue;
+    }
+    const char *path = table->strings + offset;
+    size_t slot = hash_path(path, strlen(path)) & (num_slots - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    slots[slot] = offset;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->num_slots = num_slots;
+  return 0;
+}
+
+// Returns the offset of path in the strings, added if not there yet
+static long intern_path(vma_table_t *table, const char *path, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  // the mappings of a file are next to each other
+  if (table->num_vmas > 0) {
+    const char *last = table->strings + table->vmas[table->num_vmas - 1].path;
+    if (strncmp(last, path, len) == 0 && last[len] == '\0') {
+      return table->vmas[table->num_vmas - 1].path;
+    }
+  }
+
+  size_t slot = hash_path(path, len) & (table->num_slots - 1);
+  while (table->slots[slot] != 0) {
+    const char *interned = table->strings + table->slots[slot];
+    if (strncmp(interned, path, len) == 0 && interned[len] == '\0') {
+      return table->slots[slot];
+    }
+    slot = (slot + 1) & (table->num_slots - 1);
+  }
+  if (table->strings_size + len + 1 > VMA_TABLE_MAX_STRINGS) {
+    fprintf(stderr, "Too many mapped paths\n");
+    return -1;
+  }
+  long offset = table->strings_size;
+  memcpy(table->strings + offset, path, len);
+  table->strings[offset + len] = '\0';
+  table->strings_size += len + 1;
+  table->slots[slot] = offset;
+  table->num_paths++;
+  // keep the table at most half full
+  if (table->num_paths * 2 > table->num_slots && grow_slots(table) == -1) {
+    return -1;
+  }
+  return offset;
+}
+
+static int add_vma(vma_table_t *table, unsigned long start, unsigned long end,
+                   unsigned long offset, const char *permissions,
+                   const char *path, size_t path_len) {
+  if (table->num_vmas >= VMA_TABLE_MAX_VMAS) {
+    fprintf(stderr, "Too many mappings\n");
+    return -1;
+  }
+  long path_offset = intern_path(table, path, path_len);
+  if (path_offset == -1) {
+    return -1;
+  }
+  vma_t *vma = &table->vmas[table->num_vmas++];
+  vma->start = start;
+  vma->end = end;
+  vma->offset = offset;
+  vma->path = path_offset;
+  memcpy(vma->permissions, permissions, sizeof(vma->permissions));
+  return 0;
+}
+
+static const char *parse_hex(const char *p, unsigned long *value) {
+  unsigned long v = 0;
+  for (;; p++) {
+    if (*p >= '0' && *p <= '9') {
+      v = (v << 4) | (*p - '0');
+    } else if (*p >= 'a' && *p <= 'f') {
+      v = (v << 4) | (*p - 'a' + 10);
+    } else {
+      break;
+    }
+  }
+  *value = v;
+  return p;
+}
+
+// Parse one line of the maps, without its newline:
+// start-end perms offset dev inode pathname
+static int parse_line(const char *line, const char *end, vma_table_t *table) {
+  unsigned long start, stop, offset;
+  const char *p = parse_hex(line, &start);
+  if (*p++ != '-') {
+    goto fail;
+  }
+  p = parse_hex(p, &stop);
+  if (*p++ != ' ' || end - p < 5 || p[4] != ' ') {
+    goto fail;
+  }
+  const char *permissions = p;
+  p = parse_hex(p + 5, &offset);
+  if (*p++ != ' ') {
+    goto fail;
+  }
+  // skip the device and the inode
+  for (int field = 0; field < 2; field++) {
+    while (p < end && *p != ' ') {
+      p++;
+    }
+    if (p == end) {
+      goto fail;
+    }
+    p++;
+  }
+  while (p < end && *p == ' ') {
+    p++;
+  }
+  return add_vma(table, start, stop, offset, permissions, p, end - p);
+
+fail:
+  fprintf(stderr, "Failed to parse line: %.*s\n", (int)(end - line), line);
+  return -1;
+}
+
+static int parse_maps(int maps_fd, vma_table_t *table) {
+  size_t capacity = MAPS_READ_SIZE;
+  char *buf = malloc(capacity);
+  size_t len = 0;
+  int ret = 0;
+  if (!buf) {
+    perror("malloc maps");
+    return -1;
+  }
+  for (;;) {
+    if (capacity - len < MAPS_READ_SIZE) {
+      capacity *= 2;
+      char *new_buf = realloc(buf, capacity);
+      if (!new_buf) {
+        perror("realloc maps");
+        free(buf);
+        return -1;
+      }
+      buf = new_buf;
+    }
+    ssize_t n = read(maps_fd, buf + len, capacity - len);
+    if (n == -1) {
+      perror("read maps");
+      free(buf);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+  }
+  buf[len] = '\0'; // the parser of a cut last line stops there
+
+  const char *p = buf;
+  const char *end = buf + len;
+  while (p < end && ret == 0) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) {
+      eol = end;
+    }
+    ret = parse_line(p, eol, table);
+    p = eol + 1;
+  }
+  free(buf);
+  return ret;
+}
+
+int read_vmas(pid_t pid, vma_table_t *table) {
+  char maps_path[256];
+  snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", pid);
+  int maps_fd = open(maps_path, O_RDONLY);
+  if (maps_fd == -1) {
+    perror("open maps");
+    return -1;
+  }
+  if (init_table(table) == -1) {
+    close(maps_fd);
+    return -1;
+  }
+  int ret = parse_maps(maps_fd, table);
+  close(maps_fd);
+  if (ret == -1) {
+    free_vmas(table);
+  }
+  return ret;
+}
+
+const char *vma_path(const vma_table_t *table, const vma_t *vma) {
+  return table->strings + vma->path;
+}
+
+void free_vmas(vma_table_t *table) {
+  if (table->vmas) {
+    munmap(table->vmas, VMA_TABLE_MAX_VMAS * sizeof(vma_t));
+  }
+  if (table->strings) {
+    munmap(table->strings, VMA_TABLE_MAX_STRINGS);
+  }
+  free(table->slots);
+  memset(table, 0, sizeof(*table));
+}
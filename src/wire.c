@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include "wire.h"
+#include "ptrace.h"
+#include "zeropage.h"
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+static size_t total_sent_bytes = 0;
+
+size_t wire_bytes_sent(void) {
+  return __atomic_load_n(&total_sent_bytes, __ATOMIC_RELAXED);
+}
+
+int send_all(int socket_fd, const void *buf, size_t len) {
+  // TCP may accept fewer bytes than requested. A closed peer is reported as
+  // EPIPE rather than killing us with SIGPIPE.
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t ret =
+        send(socket_fd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+    if (ret == -1) {
+      return -1;
+    }
+    sent += ret;
+  }
+  __atomic_fetch_add(&total_sent_bytes, len, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int writev_all(int socket_fd, struct iovec *iov, int iovcnt) {
+  // TCP may accept part of the buffers: skip what was sent and retry. A
+  // closed peer is reported as EPIPE rather than killing us with SIGPIPE.
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  size_t total = len;
+  while (len > 0) {
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+    };
+    ssize_t ret = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+    if (ret == -1) {
+      return -1;
+    }
+    len -= ret;
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  __atomic_fetch_add(&total_sent_bytes, total, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int recv_all(int socket_fd, void *buf, size_t len) {
+  // TCP will send in multiple chunks
+  size_t received = 0;
+  while (received < len) {
+    ssize_t ret = recv(socket_fd, (char *)buf + received, len - received, 0);
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    received += ret;
+  }
+  return 0;
+}
+
+static int send_record(int socket_fd, unsigned long start,
+                       const char *content, size_t size,
+                       compressor_t *compressor) {
+  size_t compressed = 0;
+  if (compressor && size > 0 && !(size & PAGE_RECORD_ZERO)) {
+    compressed = compressor_try(compressor, content, size);
+    if (compressed > 0) {
+      size |= PAGE_RECORD_COMPRESSED;
+      content = compressor->buf;
+    }
+  }
+
+  // the header and the contents go out in one syscall
+  uint64_t header[3] = {htole64(start), htole64(size), htole64(compressed)};
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = compressed > 0 ? 24 : 16},
+      {.iov_base = (void *)content, .iov_len = 0},
+  };
+  size_t len = 0;
+  if (size > 0 && !(size & PAGE_RECORD_ZERO)) {
+    len = compressed > 0 ? compressed : size;
+    iov[1].iov_len = len;
+  }
+  uint64_t send_start = get_time_ns();
+  if (writev_all(socket_fd, iov, 2) == -1) {
+    perror("send page record");
+    return -1;
+  }
+  // the send time tells the compressor how fast the link is
+  if (compressor && len > 0) {
+    compressor_account_link(compressor, len, get_time_ns() - send_start);
+  }
+  return 0;
+}
+
+static int send_delta(int socket_fd, unsigned long start, const char *delta,
+                      size_t len) {
+  uint64_t header[3] = {htole64(start), htole64(PAGE_SIZE | PAGE_RECORD_DELTA),
+                        htole64(len)};
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void *)delta, .iov_len = len},
+  };
+  if (writev_all(socket_fd, iov, 2) == -1) {
+    perror("send page delta");
+    return -1;
+  }
+  return 0;
+}
+
+static int send_full_pages(int socket_fd, unsigned long start,
+                           const char *content, size_t size,
+                           const page_encoder_t *encoder) {
+  if (send_record(socket_fd, start, content, size, encoder->compressor) ==
+      -1) {
+    return -1;
+  }
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    page_cache_put(encoder->cache, start + offset, content + offset);
+  }
+  return 0;
+}
+
+static int send_cached_pages(int socket_fd, unsigned long start,
+                             const char *content, size_t size,
+                             const page_encoder_t *encoder) {
+  // pages with a small enough delta are sent one by one, the pages between
+  // them in full records
+  char delta[XBZRLE_MAX_DELTA];
+  size_t first = 0; // first page not sent yet
+  for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+    ssize_t len = page_cache_encode(encoder->cache, start + offset,
+                                    content + offset, delta, sizeof(delta));
+    if (len == -1) {
+      continue;
+    }
+    if ((offset > first &&
+         send_full_pages(socket_fd, start + first, content + first,
+                         offset - first, encoder) == -1) ||
+        send_delta(socket_fd, start + offset, delta, len) == -1) {
+      return -1;
+    }
+    first = offset + PAGE_SIZE;
+  }
+  if (first < size) {
+    return send_full_pages(socket_fd, start + first, content + first,
+                           size - first, encoder);
+  }
+  return 0;
+}
+
+int send_pages(int socket_fd, unsigned long start, const char *content,
+               size_t size, const page_encoder_t *encoder) {
+  compressor_t *compressor = encoder ? encoder->compressor : NULL;
+  page_cache_t *cache = encoder ? encoder->cache : NULL;
+  if (size == 0 || size % PAGE_SIZE != 0) {
+    return send_record(socket_fd, start, content, size, compressor);
+  }
+
+  // split the pages into runs of zero and non-zero pages, zero runs are sent
+  // as a marker without contents
+  size_t offset = 0;
+  while (offset < size) {
+    uint64_t scan_start = get_time_ns();
+    bool zero = is_zero_page(content + offset);
+    size_t run = PAGE_SIZE;
+    while (offset + run < size &&
+           is_zero_page(content + offset + run) == zero) {
+      run += PAGE_SIZE;
+    }
+    zero_scan_account(run / PAGE_SIZE, zero ? run / PAGE_SIZE : 0,
+                      get_time_ns() - scan_start);
+
+    int ret;
+    if (zero) {
+      // the destination drops its copy, so must the cache
+      for (size_t i = 0; cache && i < run; i += PAGE_SIZE) {
+        page_cache_drop(cache, start + offset + i);
+      }
+      ret = send_record(socket_fd, start + offset, NULL,
+                        run | PAGE_RECORD_ZERO, NULL);
+    } else if (cache) {
+      ret = send_cached_pages(socket_fd, start + offset, content + offset, run,
+                              encoder);
+    } else {
+      ret = send_record(socket_fd, start + offset, content + offset, run,
+                        compressor);
+    }
+    if (ret == -1) {
+      return -1;
+    }
+    offset += run;
+  }
+  return 0;
+}
+
+int send_round_end(int socket_fd, bool last) {
+  return send_record(socket_fd, last ? 0 : PAGE_RECORD_MORE_ROUNDS, NULL, 0,
+                     NULL);
+}
+
+int send_layout_next(int socket_fd) {
+  return send_record(socket_fd, PAGE_RECORD_LAYOUT, NULL, 0, NULL);
+}
+
+int recv_page_header(int socket_fd, unsigned long *start, size_t *size) {
+  uint64_t header[2];
+  if (recv_all(socket_fd, header, sizeof(header)) == -1) {
+    perror("recv page record");
+    return -1;
+  }
+  *start = le64toh(header[0]);
+  *size = le64toh(header[1]);
+  return 0;
+}
+
+int recv_page_content(int socket_fd, size_t size, char *content) {
+  if (!(size & (PAGE_RECORD_COMPRESSED | PAGE_RECORD_DELTA))) {
+    if (recv_all(socket_fd, content, size) == -1) {
+      perror("recv page contents");
+      return -1;
+    }
+    return 0;
+  }
+
+  bool delta = size & PAGE_RECORD_DELTA;
+  size = PAGE_RECORD_SIZE(size);
+  uint64_t encoded;
+  if (recv_all(socket_fd, &encoded, sizeof(encoded)) == -1) {
+    perror("recv encoded size");
+    return -1;
+  }
+  encoded = le64toh(encoded);
+  if (encoded > (delta ? XBZRLE_MAX_DELTA : COMPRESS_BOUND(size)) ||
+      (delta && size != PAGE_SIZE)) {
+    fprintf(stderr, "Encoded page record too large: %lu bytes\n", encoded);
+    return -1;
+  }
+  char *buf = malloc(encoded);
+  if (encoded > 0 && !buf) {
+    perror("malloc encoded contents");
+    return -1;
+  }
+  if (recv_all(socket_fd, buf, encoded) == -1) {
+    perror("recv encoded contents");
+    free(buf);
+    return -1;
+  }
+  int ret = delta ? xbzrle_decode(buf, encoded, content)
+                  : decompress_block(buf, encoded, content, size);
+  if (ret == -1) {
+    fprintf(stderr, "Corrupted page record\n");
+  }
+  free(buf);
+  return ret;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+uint32_t wire_checksum(uint32_t crc, const void *buf, size_t len) {
+  // CRC-32 (IEEE), with the table built at the first call
+  pthread_once(&crc_table_once, build_crc_table);
+
+  const unsigned char *p = buf;
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint32_t hash_string(const char *string) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (; *string; string++) {
+    hash = (hash ^ (unsigned char)*string) * 16777619u;
+  }
+  return hash;
+}
+
+static int grow_string_slots(string_table_t *table) {
+  size_t num_slots = table->num_slots ? table->num_slots * 2 : 256;
+  uint32_t *slots = calloc(num_slots, sizeof(*slots));
+  if (!slots) {
+    perror("calloc string slots");
+    return -1;
+  }
+  for (size_t i = 0; i < table->num_slots; i++) {
+    if (table->slots[i] == 0) {
+      continue;
+    }
+    size_t slot = hash_string(table->strings + table->slots[i] - 1) &
+                  (num_slots - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (num_slots - 1);
+    }
+    slots[slot] = table->slots[i];
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->num_slots = num_slots;
+  return 0;
+}
+
+long add_string(string_table_t *table, const char *path) {
+  // keep the slots at most half full
+  if ((table->num_strings + 1) * 2 > table->num_slots &&
+      grow_string_slots(table) == -1) {
+    return -1;
+  }
+  size_t slot = hash_string(path) & (table->num_slots - 1);
+  while (table->slots[slot] != 0) {
+    if (strcmp(table->strings + table->slots[slot] - 1, path) == 0) {
+      return table->slots[slot] - 1;
+    }
+    slot = (slot + 1) & (table->num_slots - 1);
+  }
+
+  size_t len = strlen(path) + 1;
+  if (table->size + len > UINT32_MAX) {
+    fprintf(stderr, "String table too large\n");
+    return -1;
+  }
+  if (table->size + len > table->capacity) {
+    size_t new_capacity = table->capacity ? table->capacity * 2 : 1024;
+    while (new_capacity < table->size + len) {
+      new_capacity *= 2;
+    }
+    char *new_strings = realloc(table->strings, new_capacity);
+    if (!new_strings) {
+      perror("realloc string table");
+      return -1;
+    }
+    table->strings = new_strings;
+    table->capacity = new_capacity;
+  }
+  long offset = table->size;
+  memcpy(table->strings + offset, path, len);
+  table->size += len;
+  table->slots[slot] = offset + 1;
+  table->num_strings++;
+  return offset;
+}
+
+void free_strings(string_table_t *table) {
+  free(table->strings);
+  free(table->slots);
+  memset(table, 0, sizeof(*table));
+}
+
+int send_hello(int socket_fd, uint64_t migration, int mode, int num_streams,
+               int stream) {
+  wire_hello_t hello = {
+      .magic = htole32(WIRE_MAGIC),
+      .version = htole16(WIRE_VERSION),
+      .mode = htole16(mode),
+      .migration = htole64(migration),
+      .num_streams = htole16(num_streams),
+      .stream = htole16(stream),
+  };
+  hello.checksum =
+      htole32(wire_checksum(0, &hello, offsetof(wire_hello_t, checksum)));
+  if (send_all(socket_fd, &hello, sizeof(hello)) == -1) {
+    perror("send hello");
+    return -1;
+  }
+  return 0;
+}
+
+int check_hello(const wire_hello_t *hello, uint64_t *migration, int *mode,
+                int *num_streams, int *stream) {
+  if (le32toh(hello->magic) != WIRE_MAGIC ||
+      le32toh(hello->checksum) !=
+          wire_checksum(0, hello, offsetof(wire_hello_t, checksum))) {
+    fprintf(stderr, "Invalid hello, not a checkpoint stream\n");
+    return -1;
+  }
+  if (le16toh(hello->version) != WIRE_VERSION) {
+    fprintf(stderr, "Unsupported wire version %u, expected %u\n",
+            le16toh(hello->version), WIRE_VERSION);
+    return -1;
+  }
+  *mode = le16toh(hello->mode);
+  *migration = le64toh(hello->migration);
+  *num_streams = le16toh(hello->num_streams);
+  *stream = le16toh(hello->stream);
+  return 0;
+}
+
+int send_resumed(int socket_fd, uint64_t restore_ns) {
+  wire_resumed_t resumed = {
+      .magic = htole32(WIRE_MAGIC),
+      .restore_ns = htole64(restore_ns),
+  };
+  resumed.checksum = htole32(
+      wire_checksum(0, &resumed, offsetof(wire_resumed_t, checksum)));
+  if (send_all(socket_fd, &resumed, sizeof(resumed)) == -1) {
+    perror("send resumed");
+    return -1;
+  }
+  return 0;
+}
+
+int recv_resumed(int socket_fd, uint64_t *restore_ns) {
+  wire_resumed_t resumed;
+  if (recv_all(socket_fd, &resumed, sizeof(resumed)) == -1) {
+    fprintf(stderr, "The destination did not resume the process\n");
+    return -1;
+  }
+  if (le32toh(resumed.magic) != WIRE_MAGIC ||
+      le32toh(resumed.checksum) !=
+          wire_checksum(0, &resumed, offsetof(wire_resumed_t, checksum))) {
+    fprintf(stderr, "Invalid resume message\n");
+    return -1;
+  }
+  *restore_ns = le64toh(resumed.restore_ns);
+  return 0;
+}
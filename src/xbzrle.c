@@ -0,0 +1,245 @@
+#include "xbzrle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t put_varint(char *out, size_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+static int get_varint(const char *in, size_t len, size_t *pos, size_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*pos >= len) {
+      return -1;
+    }
+    unsigned char byte = in[(*pos)++];
+    *value |= (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+ssize_t xbzrle_encode(const char *old, const char *new, char *delta,
+                      size_t cap) {
+  size_t len = 0, i = 0;
+  while (i < PAGE_SIZE) {
+    // unchanged run, compared a word at a time
+    size_t start = i;
+    while (i + sizeof(uint64_t) <= PAGE_SIZE &&
+           memcmp(old + i, new + i, sizeof(uint64_t)) == 0) {
+      i += sizeof(uint64_t);
+    }
+    while (i < PAGE_SIZE && old[i] == new[i]) {
+      i++;
+    }
+    if (i == PAGE_SIZE) {
+      break; // the trailing unchanged run is implied
+    }
+    size_t unchanged = i - start;
+
+    // changed run
+    start = i;
+    while (i < PAGE_SIZE && old[i] != new[i]) {
+      i++;
+    }
+    size_t changed = i - start;
+
+    // each varint takes at most 2 bytes for a page
+    if (len + 4 + changed > cap) {
+      return -1;
+    }
+    len += put_varint(delta + len, unchanged);
+    len += put_varint(delta + len, changed);
+    memcpy(delta + len, new + start, changed);
+    len += changed;
+  }
+  return len;
+}
+
+int xbzrle_decode(const char *delta, size_t len, char *page) {
+  size_t pos = 0, i = 0;
+  while (pos < len) {
+    size_t unchanged, changed;
+    if (get_varint(delta, len, &pos, &unchanged) == -1 ||
+        get_varint(delta, len, &pos, &changed) == -1 ||
+        unchanged > PAGE_SIZE - i || changed > PAGE_SIZE - i - unchanged ||
+        changed > len - pos) {
+      return -1;
+    }
+    i += unchanged;
+    memcpy(page + i, delta + pos, changed);
+    i += changed;
+    pos += changed;
+  }
+  return 0;
+}
+
+static size_t hash_addr(const page_cache_t *cache, unsigned long addr) {
+  return ((addr / PAGE_SIZE) * 0x9E3779B97F4A7C15UL) >> 32 &
+         (cache->num_buckets - 1);
+}
+
+int page_cache_init(page_cache_t *cache, size_t budget) {
+  memset(cache, 0, sizeof(*cache));
+  cache->capacity = budget / PAGE_SIZE;
+  cache->num_buckets = 1;
+  while (cache->num_buckets < 2 * cache->capacity) {
+    cache->num_buckets *= 2;
+  }
+  cache->data = aligned_alloc(PAGE_SIZE, cache->capacity * PAGE_SIZE);
+  cache->entries = malloc(cache->capacity * sizeof(page_cache_entry_t));
+  cache->buckets = malloc(cache->num_buckets * sizeof(int32_t));
+  if (!cache->data || !cache->entries || !cache->buckets) {
+    perror("malloc page cache");
+    page_cache_free(cache);
+    return -1;
+  }
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    cache->buckets[i] = -1;
+  }
+  cache->lru_head = cache->lru_tail = cache->free_list = -1;
+  pthread_mutex_init(&cache->lock, NULL);
+  return 0;
+}
+
+void page_cache_free(page_cache_t *cache) {
+  if (cache->data && cache->entries && cache->buckets) {
+    pthread_mutex_destroy(&cache->lock);
+  }
+  free(cache->data);
+  free(cache->entries);
+  free(cache->buckets);
+  cache->data = NULL;
+  cache->entries = NULL;
+  cache->buckets = NULL;
+}
+
+static int32_t lookup(page_cache_t *cache, unsigned long addr) {
+  int32_t i = cache->buckets[hash_addr(cache, addr)];
+  while (i != -1 && cache->entries[i].addr != addr) {
+    i = cache->entries[i].hash_next;
+  }
+  return i;
+}
+
+static void lru_unlink(page_cache_t *cache, int32_t i) {
+  page_cache_entry_t *entry = &cache->entries[i];
+  if (entry->lru_prev != -1) {
+    cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+  } else {
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != -1) {
+    cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+}
+
+static void lru_push(page_cache_t *cache, int32_t i) {
+  page_cache_entry_t *entry = &cache->entries[i];
+  entry->lru_prev = -1;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head != -1) {
+    cache->entries[cache->lru_head].lru_prev = i;
+  } else {
+    cache->lru_tail = i;
+  }
+  cache->lru_head = i;
+}
+
+static void remove_entry(page_cache_t *cache, int32_t i) {
+  int32_t *link = &cache->buckets[hash_addr(cache, cache->entries[i].addr)];
+  while (*link != i) {
+    link = &cache->entries[*link].hash_next;
+  }
+  *link = cache->entries[i].hash_next;
+  lru_unlink(cache, i);
+}
+
+ssize_t page_cache_encode(page_cache_t *cache, unsigned long addr,
+                          const char *page, char *delta, size_t cap) {
+  if (cache->capacity == 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&cache->lock);
+  cache->num_lookups++;
+  ssize_t len = -1;
+  int32_t i = lookup(cache, addr);
+  if (i != -1) {
+    char *cached = cache->data + (size_t)i * PAGE_SIZE;
+    len = xbzrle_encode(cached, page, delta, cap);
+    if (len != -1) {
+      memcpy(cached, page, PAGE_SIZE);
+      lru_unlink(cache, i);
+      lru_push(cache, i);
+      cache->num_deltas++;
+      cache->delta_bytes += len;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return len;
+}
+
+void page_cache_put(page_cache_t *cache, unsigned long addr,
+                    const char *page) {
+  if (cache->capacity == 0) {
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  int32_t i = lookup(cache, addr);
+  if (i != -1) {
+    lru_unlink(cache, i);
+  } else {
+    // take a free entry, or evict the least recently used one
+    if (cache->free_list != -1) {
+      i = cache->free_list;
+      cache->free_list = cache->entries[i].lru_next;
+    } else if (cache->count < cache->capacity) {
+      i = cache->count++;
+    } else {
+      i = cache->lru_tail;
+      remove_entry(cache, i);
+    }
+    size_t bucket = hash_addr(cache, addr);
+    cache->entries[i].addr = addr;
+    cache->entries[i].hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+  }
+  memcpy(cache->data + (size_t)i * PAGE_SIZE, page, PAGE_SIZE);
+  lru_push(cache, i);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void page_cache_drop(page_cache_t *cache, unsigned long addr) {
+  if (cache->capacity == 0) {
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  int32_t i = lookup(cache, addr);
+  if (i != -1) {
+    remove_entry(cache, i);
+    cache->entries[i].lru_next = cache->free_list;
+    cache->free_list = i;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void page_cache_report(const page_cache_t *cache) {
+  if (cache->num_lookups == 0) {
+    return;
+  }
+  printf("Delta pages: %zu of %zu pages sent as deltas, %zu bytes instead of "
+         "%zu\n",
+         cache->num_deltas, cache->num_lookups, cache->delta_bytes,
+         cache->num_deltas * PAGE_SIZE);
+}
@@ -0,0 +1,60 @@
+#include "ptrace.h"
+#include "zeropage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Number of passes over the buffer, the fastest one is reported
+#define BENCH_PASSES 5
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [buffer MiB]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t size = (argc == 2 ? strtoul(argv[1], NULL, 10) : 256) << 20;
+  if (size == 0) {
+    fprintf(stderr, "Invalid buffer size: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  // zero pages are the worst case, every scanner reads them to the end
+  char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    perror("mmap buffer");
+    return EXIT_FAILURE;
+  }
+  memset(buf, 0, size); // populated, so that no fault is timed
+
+  zero_page_scanner_t scanners[ZERO_PAGE_MAX_SCANNERS];
+  size_t num_scanners = zero_page_scanners(scanners);
+  printf("Scanning %zu MiB of zero pages, best of %d passes\n", size >> 20,
+         BENCH_PASSES);
+  for (size_t i = 0; i < num_scanners; i++) {
+    uint64_t best_ns = UINT64_MAX;
+    size_t zero_pages = 0;
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+      zero_pages = 0;
+      uint64_t start = get_time_ns();
+      for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        zero_pages += scanners[i].is_zero_page(buf + offset);
+      }
+      uint64_t ns = get_time_ns() - start;
+      if (ns < best_ns) {
+        best_ns = ns;
+      }
+    }
+    if (zero_pages != size / PAGE_SIZE) {
+      fprintf(stderr, "%s: %zu of %zu pages found zero\n", scanners[i].name,
+              zero_pages, size / PAGE_SIZE);
+      munmap(buf, size);
+      return EXIT_FAILURE;
+    }
+    printf("%-7s %.2f GB/s\n", scanners[i].name, (double)size / best_ns);
+  }
+
+  munmap(buf, size);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+#include "zeropage.h"
+#include <stdint.h>
+#include <stdio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool is_zero_page_scalar(const char *page) {
+  const uint64_t *words = (const uint64_t *)page;
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 8) {
+    if ((words[i] | words[i + 1] | words[i + 2] | words[i + 3] | words[i + 4] |
+         words[i + 5] | words[i + 6] | words[i + 7]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(__x86_64__)
+static bool is_zero_page_sse2(const char *page) {
+  for (size_t i = 0; i < PAGE_SIZE; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(page + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(page + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(page + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(page + i + 48));
+    __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+        0xFFFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+__attribute__((target("avx2"))) static bool
+is_zero_page_avx2(const char *page) {
+  for (size_t i = 0; i < PAGE_SIZE; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(page + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(page + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(page + i + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(page + i + 96));
+    __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(acc, acc)) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+size_t zero_page_scanners(zero_page_scanner_t *scanners) {
+  size_t num_scanners = 0;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scanners[num_scanners++] =
+        (zero_page_scanner_t){"avx2", is_zero_page_avx2};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    scanners[num_scanners++] =
+        (zero_page_scanner_t){"sse2", is_zero_page_sse2};
+  }
+#endif
+  scanners[num_scanners++] =
+      (zero_page_scanner_t){"scalar", is_zero_page_scalar};
+  return num_scanners;
+}
+
+static bool (*zero_page_impl)(const char *page) = NULL;
+static const char *zero_page_impl_name = NULL;
+
+static void select_zero_page_impl(void) {
+  // every thread picks the same scanner, so racing here is harmless
+  zero_page_scanner_t scanners[ZERO_PAGE_MAX_SCANNERS];
+  zero_page_scanners(scanners);
+  zero_page_impl_name = scanners[0].name;
+  zero_page_impl = scanners[0].is_zero_page;
+}
+
+bool is_zero_page(const char *page) {
+  if (zero_page_impl == NULL) {
+    select_zero_page_impl();
+  }
+  return zero_page_impl(page);
+}
+
+const char *zero_page_scanner(void) {
+  if (zero_page_impl == NULL) {
+    select_zero_page_impl();
+  }
+  return zero_page_impl_name;
+}
+
+static size_t total_scanned_pages = 0;
+static size_t total_zero_pages = 0;
+static long long total_scan_ns = 0;
+
+void zero_scan_account(size_t scanned_pages, size_t zero_pages, long long ns) {
+  __atomic_fetch_add(&total_scanned_pages, scanned_pages, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&total_zero_pages, zero_pages, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&total_scan_ns, ns, __ATOMIC_RELAXED);
+}
+
+void zero_scan_report(void) {
+  double gigabytes = (double)total_scanned_pages * PAGE_SIZE / 1e9;
+  double seconds = (double)total_scan_ns / 1e9;
+  printf("Zero pages: %zu of %zu scanned (%s), scan %.2f GB/s\n",
+         total_zero_pages, total_scanned_pages, zero_page_scanner(),
+         seconds > 0 ? gigabytes / seconds : 0.0);
+}